@@ -51,6 +51,16 @@ void find_vec_minmax(double* output_min, double *output_max, double* vec, long N
 
 void add_new_uv(long *obs_index, long *uvindex, double new_u, double new_v, double new_uv_lambda, double new_uv_dlambda, double new_uv_time, double *table_u, double *table_v, double *table_uv_lambda, double *table_uv_dlambda, double *table_uv_time, double uvtol);
 
+// Reorder a uv table in place: element i moves to position newindex[i]
+void permute_uv_table(double *table, const long *newindex, long N)
+{
+        double *temp = malloc(N * sizeof(double));
+        for (long i = 0; i < N; i++)
+                temp[newindex[i]] = table[i];
+        memcpy(table, temp, N * sizeof(double));
+        free(temp);
+}
+
 int import_single_epoch_oifits(char *filename, bool use_v2, bool use_t3amp, bool use_t3phi, bool use_visamp, bool use_visphi,
                                double v2a, double v2s, double t3ampa, double t3amps, double t3phia, double t3phis,
                                double visampa, double visamps, double visphia, double visphis, double fluxs, double cwhm, double uvtol, int* pnwavr,
@@ -743,6 +753,61 @@ int import_single_epoch_oifits(char *filename, bool use_v2, bool use_t3amp, bool
                         getchar();
                 }
         }
+
+        //
+        // Sort uv points by reconstruction channel, so that channel w owns the contiguous range
+        // chan_uv_start[w] <= j < chan_uv_start[w + 1]. Points outside of all channels are moved to the end.
+        //
+
+        chan_uv_start = malloc((nwavr + 1) * sizeof(long));
+        long *uv_cursor = malloc((nwavr + 1) * sizeof(long));
+        long *uv_newindex = malloc(nuv * sizeof(long));
+        chan_uv_start[0] = 0;
+        for (w = 0; w < nwavr; w++)
+                chan_uv_start[w + 1] = chan_uv_start[w] + nuv_chan[w];
+        for (w = 0; w < nwavr + 1; w++)
+                uv_cursor[w] = chan_uv_start[w];
+
+        for (i = 0; i < nuv; i++) // stable, so points keep their import order within a channel
+        {
+                if (uvwav2chan[i] < 0)
+                        uv_newindex[i] = uv_cursor[nwavr]++;
+                else
+                        uv_newindex[i] = uv_cursor[uvwav2chan[i]]++;
+        }
+
+        permute_uv_table(u, uv_newindex, nuv);
+        permute_uv_table(v, uv_newindex, nuv);
+        permute_uv_table(uv_lambda, uv_newindex, nuv);
+        permute_uv_table(uv_dlambda, uv_newindex, nuv);
+        permute_uv_table(uv_time, uv_newindex, nuv);
+
+        int *uvwav2chan_sorted = malloc(nuv * sizeof(int));
+        for (i = 0; i < nuv; i++)
+                uvwav2chan_sorted[uv_newindex[i]] = uvwav2chan[i];
+        free(uvwav2chan);
+        uvwav2chan = uvwav2chan_sorted;
+
+        // Renumber the observable to uv lookup tables
+        for (i = 0; i < nv2; i++)
+                v2in[i] = uv_newindex[v2in[i]];
+        for (i = 0; i < nt3; i++)
+        {
+                t3in1[i] = uv_newindex[t3in1[i]];
+                t3in2[i] = uv_newindex[t3in2[i]];
+                t3in3[i] = uv_newindex[t3in3[i]];
+        }
+        for (i = 0; i < nvis; i++)
+                visin[i] = uv_newindex[visin[i]];
+        if (diffvis == TRUE)
+                for (i = 0; i < nvis; i++)
+                        if (dvisnwav[i] > 0)
+                                for (k = 0; k < nwavr; k++)
+                                        if (dvisindx[i][k] != -1)
+                                                dvisindx[i][k] = uv_newindex[dvisindx[i][k]];
+
+        free(uv_newindex);
+        free(uv_cursor);
         free(nuv_chan);
 
 
@@ -237,6 +237,67 @@ double UDreg(const double *x, const double *pr, const double eps, const int nx,
   return L05g * L05g / flux;
 }
 
+int unique_sites(int *si, int *sj, const int nsites, const int imin, const int imax, const int jmin, const int jmax)
+{
+  // Packs the distinct sites (si[k], sj[k]) with imin <= si <= imax and jmin <= sj <= jmax at the front, returns their number
+  int k, l, n = 0;
+  for (k = 0; k < nsites; ++k)
+  {
+    if ((si[k] < imin) || (si[k] > imax) || (sj[k] < jmin) || (sj[k] > jmax))
+      continue;
+    for (l = 0; l < n; ++l)
+      if ((si[l] == si[k]) && (sj[l] == sj[k]))
+        break;
+    if (l == n)
+    {
+      si[n] = si[k];
+      sj[n] = sj[k];
+      n++;
+    }
+  }
+  return n;
+}
+
+double gradient_norm(const double *x, const int i, const int j, const int nx, const double eps)
+{
+  // squared norm of the backward difference gradient at (i, j), as summed by TV and UDreg
+  const double dx = x[i + nx * j] - x[i - 1 + nx * j];
+  const double dy = x[i + nx * j] - x[i + nx * (j - 1)];
+  return dx * dx + dy * dy + eps * eps;
+}
+
+void gradient_sums_change(double *x, const int nx, const int ny, const int old_i, const int old_j, const int new_i, const int new_j, const double eps,
+                          double *dL1g, double *dL05g)
+{
+  // Change of the TV sum L1g and of the UDreg sum L05g (before squaring) when one element moves from (old_i, old_j)
+  // to (new_i, new_j). Only the gradients at the two pixels and at their right and lower neighbours change,
+  // the first row and column being ignored as in the full sums. x is restored on return
+  int si[6] = { old_i, old_i + 1, old_i, new_i, new_i + 1, new_i };
+  int sj[6] = { old_j, old_j, old_j + 1, new_j, new_j, new_j + 1 };
+  const int nsites = unique_sites(si, sj, 6, 1, nx - 1, 1, ny - 1);
+  int k;
+  double g;
+
+  *dL1g = 0;
+  *dL05g = 0;
+  for (k = 0; k < nsites; ++k)
+  {
+    g = sqrt(gradient_norm(x, si[k], sj[k], nx, eps));
+    *dL1g -= g;
+    *dL05g -= sqrt(g);
+  }
+  x[old_i + nx * old_j] -= 1.0;
+  x[new_i + nx * new_j] += 1.0;
+  for (k = 0; k < nsites; ++k)
+  {
+    g = sqrt(gradient_norm(x, si[k], sj[k], nx, eps));
+    *dL1g += g;
+    *dL05g += sqrt(g);
+  }
+  x[old_i + nx * old_j] += 1.0;
+  x[new_i + nx * new_j] -= 1.0;
+}
+
 
 double L0(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux)
 {
@@ -344,160 +405,259 @@ double LAP(const double *x, const double *pr, const double eps, const int nx, co
   return reg / flux;
 }
 
-double EDGE(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux)
+double laplacian_norm(const double *x, const int i, const int j, const int nx, const int ny)
 {
-  // This regularizer is the Lp norm (p=0.5) on the local gradient
-  // It is somehow similar to the total variation, which is the L1 norm
-  // the gradient is evaluated by backward difference, e is the threshold
-  // by definition, L05g(x) = (sum( |grad im|^.5 ))^2
-  // Note: all image borders are ignored
-
-// also ignore if pixel borders an area of prior with logp < -13.8
-// corresponding to a value in the prior image of about 1-e6
-
-  register int i, j, m, n, off,offnonz, nnonz;
-  double dx, dy, pixreg,totalnonz, averagenonz, mediannonz,lap,maxpix,minpix,thresh;
-
+  // |Laplacian| at (i, j) as summed by LAP: 5 point stencil, zeroes outside of the image, corners ignored
+  double lap = 0;
+  int nnb = 0;
+  if (((i == 0) || (i == nx - 1)) && ((j == 0) || (j == ny - 1)))
+    return 0;
+  if (i > 0)
+  {
+    lap += x[i - 1 + nx * j];
+    nnb++;
+  }
+  if (i < nx - 1)
+  {
+    lap += x[i + 1 + nx * j];
+    nnb++;
+  }
+  if (j > 0)
+  {
+    lap += x[i + nx * (j - 1)];
+    nnb++;
+  }
+  if (j < ny - 1)
+  {
+    lap += x[i + nx * (j + 1)];
+    nnb++;
+  }
+  return fabs(lap - nnb * x[i + nx * j]);
+}
 
-  //  double pr_threshold=-13.8;
+double LAP_change(double *x, const int nx, const int ny, const int old_i, const int old_j, const int new_i, const int new_j, const double flux)
+{
+  // Change of LAP when one element moves from (old_i, old_j) to (new_i, new_j): only the stencils centred on the two pixels
+  // and on their four neighbours change. x is restored on return
+  int si[10] = { old_i, old_i - 1, old_i + 1, old_i, old_i, new_i, new_i - 1, new_i + 1, new_i, new_i };
+  int sj[10] = { old_j, old_j, old_j, old_j - 1, old_j + 1, new_j, new_j, new_j, new_j - 1, new_j + 1 };
+  const int nsites = unique_sites(si, sj, 10, 0, nx - 1, 0, ny - 1);
+  int k;
+  double change = 0;
+  for (k = 0; k < nsites; ++k)
+    change -= laplacian_norm(x, si[k], sj[k], nx, ny);
+  x[old_i + nx * old_j] -= 1.0;
+  x[new_i + nx * new_j] += 1.0;
+  for (k = 0; k < nsites; ++k)
+    change += laplacian_norm(x, si[k], sj[k], nx, ny);
+  x[old_i + nx * old_j] += 1.0;
+  x[new_i + nx * new_j] -= 1.0;
+  return change / flux;
+}
 
- double L05edge = - sqrt(eps) * (double)(nx * ny) ;
-double  L1edge = 0.0;
-nnonz=0.0;
-totalnonz=0.0;
-lap=0.0;
-maxpix=0.0;
-minpix=100000000;
-//calculate mean of non zero pixels
-for (m= 0; m <(ny*nx) ; m++)
-	{
-	if (x[m] >0.0)
-		{
-     if (x[m]> maxpix)
-     {
-       maxpix=x[m];
-     }
-     if (x[m]< minpix)
+void edge_stats_full(edge_stats *stats, const double *x, const int npix)
+{
+  // Statistics of the nonzero pixels that set the EDGE threshold
+  int m;
+  stats->total = 0;
+  stats->nnonz = 0;
+  stats->max = 0;
+  stats->min = 100000000;
+  stats->nmax = 0;
+  stats->nmin = 0;
+  for (m = 0; m < npix; ++m)
+    if (x[m] > 0.0)
+    {
+      if (x[m] > stats->max)
       {
-        minpix=x[m];
+        stats->max = x[m];
+        stats->nmax = 0;
       }
-     totalnonz+=x[m];
-		 nnonz=nnonz+1;
-		}
-	}
-averagenonz=totalnonz/nnonz;
-mediannonz=(maxpix/maxpix-minpix/maxpix)/2.0;
-thresh=mediannonz/averagenonz;
-//compute lapacian and penalize spots with shifts if pixel average flux is greater than 1.3*average
+      if (x[m] == stats->max)
+        stats->nmax++;
+      if (x[m] < stats->min)
+      {
+        stats->min = x[m];
+        stats->nmin = 0;
+      }
+      if (x[m] == stats->min)
+        stats->nmin++;
+      stats->total += x[m];
+      stats->nnonz++;
+    }
+}
 
-   for (j = 1; j < ny - 1; j++)
+void edge_stats_pixel(edge_stats *stats, const double value, const int sign)
+{
+  // Counts (sign = 1) or uncounts (sign = -1) a pixel of the given value
+  if (value <= 0.0)
+    return;
+  stats->nnonz += sign;
+  if ((sign > 0) && (value > stats->max))
   {
-    off = nx * j;
-    for (i = 1; i < nx - 1; i++)
-	{
-	lap=fabs(x[ i - 1 + off] + x[i + 1 + off] + x[i + off - nx] + x[i + off + nx] - 4. * x[i + off]);
-		if (i > 0)
-     		 {
-       			 dx = x[ i + off] - x[ i - 1 + off];
-    	  	 }
-      		else
-      		{
-        		dx = x[ 1 + off] - x[ off];
-      		}
-
-   	   	if (j > 0)
-    	  	{
-    		    	dy = x[ i + off] - x[i + off - nx];
-   	   	}
-    	  	else
-    	  	{
-    	  		dy = x[i + nx] - x[ i ];
-     	 	}
-    	  	pixreg = sqrt(sqrt(dx * dx + dy * dy + eps * eps));
-	if (abs(lap) > 0)
-	{
-		if (x[i+off]<thresh) //instead of 0.8*averagenonz
-		{
-			L05edge+=pixreg;
-		}
-		else
-		{
-			L1edge+=lap;
-		}
-
-	}
-
-    // case i = 0
-      lap= fabs(x[1 + off] + x[off - nx] + x[off + nx] - 3. * x[off]);
-	if (abs(lap) > 0)
-	{
-		if (x[i+off]<thresh)
-		{
-			L05edge+=pixreg;
-		}
-		else
-		{
-			L1edge+=lap;
-		}
-
-	}
-    // case i = nx -1
-    lap= fabs(x[ nx - 2 + off] + x[nx - 1 + off - nx] + x[nx - 1  + off + nx] - 3. * x[nx - 1 + off]);
-	if (lap > 0)
-	{
-		if (x[i+off]<thresh)
-		{
-			L05edge+=pixreg;
-		}
-		else
-		{
-			L1edge+=lap;
-		}
-
-	}
+    stats->max = value;
+    stats->nmax = 0;
   }
-  for (i = 1; i < nx - 1; i++)
+  if ((sign > 0) && (value < stats->min))
   {
-    // case j = 0
-    off = 0 ;
-    lap= fabs(x[ i - 1 ] + x[i + 1] + x[i + off + nx] - 3. * x[i + off]);
-    if (abs(lap) > 0)
-	{
-		if (x[i+off] < thresh)
-		{
-			L05edge+=pixreg;
-		}
-		else
-		{
-			L1edge+=lap;
-		}
+    stats->min = value;
+    stats->nmin = 0;
+  }
+  if (value == stats->max)
+    stats->nmax += sign;
+  if (value == stats->min)
+    stats->nmin += sign;
+}
 
-	}
-    // case j = nx -1
-    off = nx * (nx - 1);
-    lap= fabs(x[ i - 1 + off] + x[i + 1 + off] + x[i + off - nx] - 3. * x[i + off]);
-  if (abs(lap) > 0)
-	{
-		if (x[i+off] < thresh)
-		{
-			L05edge+=pixreg;
-		}
-		else
-		{
-			L1edge+=lap;
-		}
+void edge_stats_move(edge_stats *stats, double *x, const long old_pos, const long new_pos, const int npix)
+{
+  // Updates the statistics for one element moving from old_pos to new_pos, x being the image before the move.
+  // When the last pixel at the maximum or minimum goes and the moved pixels do not reach it, the new extreme
+  // is unknown and the pixels are counted again. x is restored on return
+  const double old_value = x[old_pos], new_value = x[new_pos];
+  if (old_pos == new_pos)
+    return;
+  edge_stats_pixel(stats, old_value, -1);
+  edge_stats_pixel(stats, new_value, -1);
+  if (((stats->nmax == 0) && (new_value + 1.0 < stats->max))
+      || ((stats->nmin == 0) && ((old_value - 1.0 <= 0.0) || (old_value - 1.0 > stats->min)) && (new_value + 1.0 > stats->min)))
+  {
+    x[old_pos] -= 1.0;
+    x[new_pos] += 1.0;
+    edge_stats_full(stats, x, npix);
+    x[old_pos] += 1.0;
+    x[new_pos] -= 1.0;
+    return;
+  }
+  edge_stats_pixel(stats, old_value - 1.0, 1);
+  edge_stats_pixel(stats, new_value + 1.0, 1);
+}
 
-//	}
+double edge_threshold(const edge_stats *stats)
+{
+  // Pixels below it are penalized on their gradient, the others on their Laplacian
+  const double averagenonz = stats->total / stats->nnonz;
+  const double mediannonz = (stats->max / stats->max - stats->min / stats->max) / 2.0;
+  return mediannonz / averagenonz;
+}
 
+void edge_row(const double *x, const int j, const double thresh, const int nx, const double eps, double *L05edge, double *L1edge)
+{
+  // Terms of EDGE summed in row j: the Laplacian of each inner pixel, and the Laplacians of the two border pixels of the
+  // row counted once per inner pixel. Each term goes to L1edge, or to L05edge as the gradient of the inner pixel when that
+  // pixel is below the threshold
+  const int off = nx * j;
+  const double lap_left = fabs(x[1 + off] + x[off - nx] + x[off + nx] - 3. * x[off]);
+  const double lap_right = fabs(x[nx - 2 + off] + x[nx - 1 + off - nx] + x[nx - 1 + off + nx] - 3. * x[nx - 1 + off]);
+  int i;
+  double lap;
+  for (i = 1; i < nx - 1; i++)
+  {
+    lap = fabs(x[i - 1 + off] + x[i + 1 + off] + x[i + off - nx] + x[i + off + nx] - 4. * x[i + off]);
+    if (x[i + off] < thresh)
+    {
+      const double pixreg = sqrt(sqrt(gradient_norm(x, i, j, nx, eps)));
+      *L05edge += ((lap > 0) + (lap_left > 0) + (lap_right > 0)) * pixreg;
+    }
+    else
+    {
+      if (lap > 0)
+        *L1edge += lap;
+      if (lap_left > 0)
+        *L1edge += lap_left;
+      if (lap_right > 0)
+        *L1edge += lap_right;
+    }
   }
 }
+
+void edge_borders(const double *x, const double thresh, const int nx, const int ny, const double eps, double *L05edge, double *L1edge)
+{
+  // Terms of EDGE for the top and bottom rows, counted once per inner row. Those below the threshold take the gradient
+  // of the last inner pixel of that row
+  const int off = nx * (ny - 1);
+  int i, j, nbelow = 0;
+  double lap, lapsum = 0, pixsum = 0;
+  for (i = 1; i < nx - 1; i++)
+  {
+    lap = fabs(x[i - 1] + x[i + 1] + x[i + nx] - 3. * x[i]);
+    if (lap > 0)
+    {
+      if (x[i] < thresh)
+        nbelow++;
+      else
+        lapsum += lap;
+    }
+    lap = fabs(x[i - 1 + off] + x[i + 1 + off] + x[i + off - nx] - 3. * x[i + off]);
+    if (lap > 0)
+    {
+      if (x[i + off] < thresh)
+        nbelow++;
+      else
+        lapsum += lap;
+    }
+  }
+  if (nbelow > 0)
+    for (j = 1; j < ny - 1; j++)
+      pixsum += sqrt(sqrt(gradient_norm(x, nx - 2, j, nx, eps)));
+  *L05edge += nbelow * pixsum;
+  *L1edge += (ny - 2) * lapsum;
 }
 
-L1edge=L1edge+(L05edge/100.);
+double EDGE(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux)
+{
+  // Penalizes spots with shifts: the L1 norm of the Laplacian on the pixels above the threshold,
+  // and the Lp norm (p=0.5) of the local gradient (backward difference) on those below, weighted by 1/100
+  // The threshold comes from the statistics of the nonzero pixels
+  int j;
+  edge_stats stats;
+  double L05edge = - sqrt(eps) * (double)(nx * ny);
+  double L1edge = 0.0;
+  edge_stats_full(&stats, x, nx * ny);
+  const double thresh = edge_threshold(&stats);
+  for (j = 1; j < ny - 1; j++)
+    edge_row(x, j, thresh, nx, eps, &L05edge, &L1edge);
+  edge_borders(x, thresh, nx, ny, eps, &L05edge, &L1edge);
+  return (L1edge + L05edge / 100.) / flux;
+}
 
-//   return L05g;
+double EDGE_change(double *x, const edge_stats *stats, const int nx, const int ny, const int old_i, const int old_j, const int new_i, const int new_j,
+                   const double eps, const double flux)
+{
+  // Change of EDGE when one element moves from (old_i, old_j) to (new_i, new_j), stats being those of the image before the move.
+  // Pixel values are element counts, so the pixels below the threshold stay the same as long as its ceiling does: then only
+  // the rows next to the two pixels and the border terms are summed again. Otherwise EDGE is computed in full. x is restored on return
+  edge_stats moved = *stats;
+  double L05edge = 0, L1edge = 0, change;
+  int rows[6] = { old_j - 1, old_j, old_j + 1, new_j - 1, new_j, new_j + 1 }, cols[6] = { 0 };
+  const int nrows = unique_sites(cols, rows, 6, 0, 0, 1, ny - 2);
+  const double thresh = edge_threshold(stats);
+  int k;
+  edge_stats_move(&moved, x, old_i + nx * old_j, new_i + nx * new_j, nx * ny);
+  if (!(ceil(edge_threshold(&moved)) == ceil(thresh)))
+  {
+    change = - EDGE(x, NULL, eps, nx, ny, flux);
+    x[old_i + nx * old_j] -= 1.0;
+    x[new_i + nx * new_j] += 1.0;
+    change += EDGE(x, NULL, eps, nx, ny, flux);
+    x[old_i + nx * old_j] += 1.0;
+    x[new_i + nx * new_j] -= 1.0;
+    return change;
+  }
 
-  return L1edge / flux;
+  for (k = 0; k < nrows; ++k)
+    edge_row(x, rows[k], thresh, nx, eps, &L05edge, &L1edge);
+  edge_borders(x, thresh, nx, ny, eps, &L05edge, &L1edge);
+  L05edge = -L05edge;
+  L1edge = -L1edge;
+  x[old_i + nx * old_j] -= 1.0;
+  x[new_i + nx * new_j] += 1.0;
+  for (k = 0; k < nrows; ++k)
+    edge_row(x, rows[k], thresh, nx, eps, &L05edge, &L1edge);
+  edge_borders(x, thresh, nx, ny, eps, &L05edge, &L1edge);
+  x[old_i + nx * old_j] += 1.0;
+  x[new_i + nx * new_j] -= 1.0;
+  return (L1edge + L05edge / 100.) / flux;
 }
 
 double reg_prior_image(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux)
@@ -522,178 +682,297 @@ double reg_prior_image(const double *x, const double *pr, const double eps, cons
 // Wavelets
 //
 
-// CDF (5,3), used in JPEG2000 -- Note: this can be sped up a lot in the future
-void fwt53(double *wav, const double* x, const int nx, const int ny)
+// CDF (5,3) and (9,7), used in JPEG2000, as lifting schemes (see cdf53_lifting and cdf97_lifting). The steps alternately predict
+// the odd samples from their even neighbours and update the even samples from their odd neighbours, with symmetric extension
+// at both ends of a line
+void lifting_range(double *t, const lifting_scheme *scheme, const int n, const int lo, const int hi)
+{
+  // Lifting steps on the n samples t of a line (n even), only as far as samples lo..hi need to reach their final value
+  // Each step widens the dependence by one sample: t must hold the input samples over lo - nsteps..hi + nsteps (within the line)
+  int s, p, first, last;
+  for (s = 0; s < scheme->nsteps; ++s)
+  {
+    const double a = scheme->a[s];
+    first = (lo - (scheme->nsteps - 1 - s) > 0) ? lo - (scheme->nsteps - 1 - s) : 0;
+    last = (hi + (scheme->nsteps - 1 - s) < n - 1) ? hi + (scheme->nsteps - 1 - s) : n - 1;
+    if ((first % 2) == (s % 2)) // predict steps (even s) work on the odd samples, update steps on the even ones
+      first++;
+    for (p = first; p <= last; p += 2)
+    {
+      if (p == 0)
+        t[0] += 2 * a * t[1];
+      else if (p == n - 1)
+        t[p] += 2 * a * t[p - 1];
+      else
+        t[p] += a * (t[p - 1] + t[p + 1]);
+    }
+  }
+}
+
+void journal_init(undo_journal *journal, const long size, scratch_arena *arena)
 {
-	const double a0 = -0.5;
-	const double a1 = 0.25;
-	const double s0 = sqrt(2.0);
-	const double s1 = sqrt(2.0) * 0.5;
-	register int i, j, off;
+  // size has to cover all the values one move writes, the journal never grows
+  journal->size = size;
+  journal->at = arena_alloc(arena, size * sizeof(double *));
+  journal->value = arena_alloc(arena, size * sizeof(double));
+  journal->n = 0;
+}
 
-	double* tempx = malloc(nx * ny * sizeof(double));
-	memcpy(tempx, x, nx * ny * sizeof(double));
+void journal_free(undo_journal *journal, scratch_arena *arena)
+{
+  arena_free(arena, journal->value);
+  arena_free(arena, journal->at);
+}
 
-	for (j = 0; j < ny; ++j)
-	{
-		off = nx * j;
-		// Predict 1
-		for (i = 1; i < nx - 1; i += 2)
-		{
-			tempx[off + i] += a0 * (tempx[off + i - 1] + tempx[off + i + 1]);
-		}
-		tempx[off + nx - 1] += 2 * a0 * tempx[off + nx - 2];
+void journal_set(undo_journal *journal, double *at, const double value)
+{
+  if (journal->n >= journal->size)
+  {
+    // A move wrote more than its journal size allows for: the values past the end could not be undone
+    printf("Error -- undo journal overflow at %ld entries\n", journal->size);
+    exit(1);
+  }
+  journal->at[journal->n] = at;
+  journal->value[journal->n++] = *at;
+  *at = value;
+}
 
-		// Update 1
-		for (i = 2; i < nx; i += 2)
-		{
-			tempx[off + i] += a1 * (tempx[off + i - 1] + tempx[off + i + 1]);
-		}
-		tempx[off] += 2 * a1 * tempx[off + 1];
+void journal_undo(undo_journal *journal)
+{
+  // Latest first, so that a value written twice gets back its first one
+  while (journal->n > 0)
+  {
+    journal->n--;
+    *journal->at[journal->n] = journal->value[journal->n];
+  }
+}
 
-	}
+void sparsity_change(const double old_value, const double new_value, double *dL0, double *dL1)
+{
+  // Changes of the L0 and L1 norms when a wavelet coefficient goes from old_value to new_value
+  *dL0 += ((fabs(new_value) > 0.0) ? 1.0 : 0.0) - ((fabs(old_value) > 0.0) ? 1.0 : 0.0);
+  *dL1 += fabs(new_value) - fabs(old_value);
+}
 
-	for (j = 0; j < ny; ++j)
-	{
-		off = nx * j;
-		for (i = 0; i < nx; ++i)
-		{
-			if (i % 2 == 0)
-				wav[(i / 2) * ny + j] = s0 * tempx[off + i];
-			else
-				wav[(nx / 2 + i / 2) * ny + j] = s1 * tempx[off + i];
-		}
-	}
-	free(tempx);
+// Even samples of a line end up as its low-pass coefficients in the first half, odd ones as the high-pass coefficients in the second
+#define LIFTED_INDEX(p, n) (((p) % 2 == 0) ? (p) / 2 : (n) / 2 + (p) / 2)
+#define LIFTED_SCALE(scheme, p) (((p) % 2 == 0) ? (scheme)->s0 : (scheme)->s1)
 
+int cdf_max_levels(const int nx, const int ny)
+{
+  // Every level halves the low-pass quadrant of the previous one, which must keep even sides
+  int levels = 0;
+  while ((levels < CDF_MAX_LEVELS) && ((nx >> levels) > 0) && ((ny >> levels) > 0) && (((nx >> levels) % 2) == 0) && (((ny >> levels) % 2) == 0))
+    levels++;
+  return levels;
 }
 
-// CDF (9,7), used in JPEG2000 -- Note: this can be sped up a lot in the future
-void fwt97(double *wav, const double* x, const int nx, const int ny)
+long cdf_journal_size(const int nx, const int ny, const int levels, const int nsteps)
 {
-	const double a0 = -1.586134342;
-	const double a1 = -0.05298011854;
-	const double a2 = 0.8829110762;
-	const double a3 = 0.4435068522;
-	const double s0 = 0.81289306611596146; // 1/1.230174104914
-	const double s1 = 0.61508705245700002; // 0.5 * 1.230174104914
-	register int i, j;
-	int off;
-	double* tempx = malloc(nx * ny * sizeof(double));
-	memcpy(tempx, x, nx * ny * sizeof(double));
+  // Samples written by one move: for each of the two pixels, a row pass then a column pass over a window at every level,
+  // the window of the next level covering the low-pass samples of this one
+  long width = 1, height = 1, wx, wy, size = 0;
+  int l;
+  for (l = 0; l < levels; ++l)
+  {
+    wx = (width + 2 * nsteps < (nx >> l)) ? width + 2 * nsteps : (nx >> l);
+    wy = (height + 2 * nsteps < (ny >> l)) ? height + 2 * nsteps : (ny >> l);
+    size += height * wx + wx * wy;
+    width = (wx + 1) / 2;
+    height = (wy + 1) / 2;
+  }
+  return 2 * size;
+}
 
-	for (j = 0; j < ny; ++j)
-	{
-		off = nx * j;
-		// Predict 1
-		for (i = 1; i < nx - 1; i += 2)
-		{
-			tempx[i + off] += a0 * (tempx[off + i - 1] + tempx[off + i + 1]);
-		}
-		tempx[off + nx - 1] += 2 * a0 * tempx[off + nx - 2];
+size_t cdf_state_bytes(const int nx, const int ny, const int levels, const int nsteps)
+{
+  // Arena bytes taken by cdf_state_init
+  const long journal = cdf_journal_size(nx, ny, levels, nsteps);
+  size_t bytes = arena_slice(nx * ny * sizeof(double)) + arena_slice(((nx > ny) ? nx : ny) * sizeof(double))
+    + arena_slice(journal * sizeof(double *)) + arena_slice(journal * sizeof(double));
+  int l;
+  for (l = 0; l < levels; ++l)
+    bytes += ((l > 0) ? 2 : 1) * arena_slice((nx >> l) * (ny >> l) * sizeof(double));
+  return bytes;
+}
 
-		// Update 1
-		for (i = 2; i < nx; i += 2)
-		{
-			tempx[off + i] += a1 * (tempx[off + i - 1] + tempx[off + i + 1]);
-		}
-		tempx[off] += 2 * a1 * tempx[off + 1];
+void cdf_state_init(cdf_state *s, const lifting_scheme *scheme, const int nx, const int ny, const int levels, scratch_arena *arena)
+{
+  int l;
+  s->scheme = scheme;
+  s->nx = nx;
+  s->ny = ny;
+  s->levels = levels;
+  s->coef = arena_alloc(arena, nx * ny * sizeof(double));
+  for (l = 0; l < levels; ++l)
+  {
+    s->input[l] = (l > 0) ? arena_alloc(arena, (nx >> l) * (ny >> l) * sizeof(double)) : NULL; // the input of the first level is the image
+    s->rows[l] = arena_alloc(arena, (nx >> l) * (ny >> l) * sizeof(double));
+  }
+  s->line = arena_alloc(arena, ((nx > ny) ? nx : ny) * sizeof(double));
+  journal_init(&s->journal, cdf_journal_size(nx, ny, levels, scheme->nsteps), arena);
+}
 
-		// Predict 2
-		for (i = 1; i < nx - 1; i += 2)
-		{
-			tempx[off + i] += a2 * (tempx[off + i - 1] + tempx[off + i + 1]);
-		}
-		tempx[off + nx - 1] += 2 * a2 * tempx[off + nx - 2];
+void cdf_state_free(cdf_state *s, scratch_arena *arena)
+{
+  int l;
+  journal_free(&s->journal, arena);
+  arena_free(arena, s->line);
+  for (l = s->levels - 1; l >= 0; --l)
+  {
+    arena_free(arena, s->rows[l]);
+    if (l > 0)
+      arena_free(arena, s->input[l]);
+  }
+  arena_free(arena, s->coef);
+}
 
-		// Update 2
-		for (i = 2; i < nx; i += 2)
-		{
-			tempx[off + i] += a3 * (tempx[off + i - 1] + tempx[off + i + 1]);
-		}
-		tempx[off] += 2 * a3 * tempx[off + 1];
+void cdf_set(cdf_state *s, double *at, const double value, const bool journal)
+{
+  if (journal == TRUE)
+    journal_set(&s->journal, at, value);
+  else
+    *at = value;
+}
 
-	}
+void cdf_store(cdf_state *s, const int level, const int row, const int col, const double value, const bool journal, double *dL0, double *dL1)
+{
+  // The low-pass quadrant of a level is the input of the next one, everything else is a final coefficient
+  const int nxl = s->nx >> level, nyl = s->ny >> level;
+  if ((level < s->levels - 1) && (row < nyl / 2) && (col < nxl / 2))
+    cdf_set(s, &s->input[level + 1][row * (nxl / 2) + col], value, journal);
+  else
+  {
+    double *at = &s->coef[row * s->nx + col];
+    if (dL0 != NULL)
+      sparsity_change(*at, value, dL0, dL1);
+    cdf_set(s, at, value, journal);
+  }
+}
 
-	// Deinterlace, transpose and scale
-	for (j = 0; j < ny; ++j)
-	{
-		off = nx * j;
-		for (i = 0; i < nx; ++i)
-		{
-			if (i % 2 == 0)
-				wav[(i / 2) * ny + j] = s0 * tempx[off + i];
-			else
-				wav[(nx / 2 + i / 2) * ny + j] = s1 * tempx[off + i];
-		}
-	}
-	free(tempx);
+void cdf_relift(cdf_state *s, const double *x, const int level, const int i0, const int i1, const int j0, const int j1, const bool journal, double *dL0,
+                double *dL1)
+{
+  // Transform of one level after its input samples i0..i1 of rows j0..j1 changed: the row pass is relifted over these rows, then
+  // the column pass over the columns it changed. The samples of the low-pass quadrant changed in turn go through the next level
+  const lifting_scheme *ls = s->scheme;
+  const int nxl = s->nx >> level, nyl = s->ny >> level;
+  const double *in = (level == 0) ? x : s->input[level];
+  const int instride = (level == 0) ? s->nx : nxl;
+  const int ilo = (i0 - ls->nsteps > 0) ? i0 - ls->nsteps : 0, ihi = (i1 + ls->nsteps < nxl - 1) ? i1 + ls->nsteps : nxl - 1;
+  const int jlo = (j0 - ls->nsteps > 0) ? j0 - ls->nsteps : 0, jhi = (j1 + ls->nsteps < nyl - 1) ? j1 + ls->nsteps : nyl - 1;
+  double *rows = s->rows[level];
+  int i, j, first, last;
+
+  first = (ilo - ls->nsteps > 0) ? ilo - ls->nsteps : 0;
+  last = (ihi + ls->nsteps < nxl - 1) ? ihi + ls->nsteps : nxl - 1;
+  for (j = j0; j <= j1; ++j)
+  {
+    for (i = first; i <= last; ++i)
+      s->line[i] = in[j * instride + i];
+    lifting_range(s->line, ls, nxl, ilo, ihi);
+    for (i = ilo; i <= ihi; ++i)
+      cdf_set(s, &rows[j * nxl + LIFTED_INDEX(i, nxl)], LIFTED_SCALE(ls, i) * s->line[i], journal);
+  }
+
+  first = (jlo - ls->nsteps > 0) ? jlo - ls->nsteps : 0;
+  last = (jhi + ls->nsteps < nyl - 1) ? jhi + ls->nsteps : nyl - 1;
+  for (i = ilo; i <= ihi; ++i)
+  {
+    const int col = LIFTED_INDEX(i, nxl);
+    for (j = first; j <= last; ++j)
+      s->line[j] = rows[j * nxl + col];
+    lifting_range(s->line, ls, nyl, jlo, jhi);
+    for (j = jlo; j <= jhi; ++j)
+      cdf_store(s, level, LIFTED_INDEX(j, nyl), col, LIFTED_SCALE(ls, j) * s->line[j], journal, dL0, dL1);
+  }
 
+  if ((level < s->levels - 1) && ((ilo + 1) / 2 <= ihi / 2) && ((jlo + 1) / 2 <= jhi / 2))
+    cdf_relift(s, x, level + 1, (ilo + 1) / 2, ihi / 2, (jlo + 1) / 2, jhi / 2, journal, dL0, dL1);
 }
 
-void fwt97_2D(double *wav, const double* x, const int nx, const int ny, const int levels)
+void cdf_state_full(cdf_state *s, const double *x)
 {
-	int i;
-	for (i = 0; i < levels; ++i)
-	{
-		fwt97(wav, x, nx, ny); // do on rows
-		fwt97(wav, wav, nx, ny); // do on cols using the result
-	}
+  cdf_relift(s, x, 0, 0, s->nx - 1, 0, s->ny - 1, FALSE, NULL, NULL);
 }
 
-void fwt53_2D(double *wav, const double* x, const int nx, const int ny, const int levels)
+void cdf_state_move(cdf_state *s, const double *x, const int old_i, const int old_j, const int new_i, const int new_j, double *dL0, double *dL1)
 {
-	int i;
-	for (i = 0; i < levels; ++i)
-	{
-		fwt53(wav, x, nx, ny); // do on rows
-		fwt53(wav, wav, nx, ny); // do on cols using the previous result
-	}
+  // x already holds the moved element. Only the samples within the lifting support of the two pixels are relifted, at each level,
+  // and dL0, dL1 get the changes of the L0 and L1 norms of the coefficients. The samples overwritten are journaled for cdf_state_undo
+  *dL0 = 0;
+  *dL1 = 0;
+  s->journal.n = 0;
+  cdf_relift(s, x, 0, old_i, old_i, old_j, old_j, TRUE, dL0, dL1);
+  cdf_relift(s, x, 0, new_i, new_i, new_j, new_j, TRUE, dL0, dL1);
+}
 
+void cdf_state_undo(cdf_state *s)
+{
+  // Back to the transform before the last cdf_state_move
+  journal_undo(&s->journal);
 }
 
-double L0_CDF97(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux)
+void cdf_2D(double *wav, const double *x, const int nx, const int ny, const int levels, const lifting_scheme *scheme, scratch_arena *arena)
 {
-  double* wav = malloc( nx * ny * sizeof(double));
-  fwt97_2D(wav, x, nx, ny, 1);
+  cdf_state s;
+  cdf_state_init(&s, scheme, nx, ny, levels, arena);
+  cdf_state_full(&s, x);
+  memcpy(wav, s.coef, nx * ny * sizeof(double));
+  cdf_state_free(&s, arena);
+}
+
+void fwt97_2D(double *wav, const double* x, const int nx, const int ny, const int levels, scratch_arena *arena)
+{
+  cdf_2D(wav, x, nx, ny, levels, &cdf97_lifting, arena);
+}
+
+void fwt53_2D(double *wav, const double* x, const int nx, const int ny, const int levels, scratch_arena *arena)
+{
+  cdf_2D(wav, x, nx, ny, levels, &cdf53_lifting, arena);
+}
+
+double L0_CDF97(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux, scratch_arena *arena)
+{
+  double* wav = arena_alloc(arena, nx * ny * sizeof(double));
+  fwt97_2D(wav, x, nx, ny, cdf_levels, arena);
   for (int i = 0; i < nx*ny; ++i)
     wav[i] = fabs(wav[i]);
   double reg = L0(wav, NULL, 0, nx, ny, 1.);
-  free(wav);
+  arena_free(arena, wav);
   return reg;
 }
 
-double L0_CDF53(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux)
+double L0_CDF53(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux, scratch_arena *arena)
 {
-  double* wav = malloc( nx * ny * sizeof(double));
-  fwt53_2D(wav, x, nx, ny, 1);
+  double* wav = arena_alloc(arena, nx * ny * sizeof(double));
+  fwt53_2D(wav, x, nx, ny, cdf_levels, arena);
   for (int i = 0; i < nx*ny; ++i)
     wav[i] = fabs(wav[i]);
   double reg = L0(wav, NULL, 0, nx, ny, 1.);
-  free(wav);
+  arena_free(arena, wav);
   return reg;
 }
 
-double L1_CDF53(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux)
+double L1_CDF53(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux, scratch_arena *arena)
 {
-  double* wav = malloc( nx * ny * sizeof(double));
-  fwt53_2D(wav, x, nx, ny, 1);
+  double* wav = arena_alloc(arena, nx * ny * sizeof(double));
+  fwt53_2D(wav, x, nx, ny, cdf_levels, arena);
   double reg = L1(wav, NULL, 0, nx, ny, 1.);
-  free(wav);
+  arena_free(arena, wav);
   return reg;
 }
 
-double L1_CDF97(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux)
+double L1_CDF97(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux, scratch_arena *arena)
 {
-  double* wav = malloc( nx * ny * sizeof(double));
-  fwt97_2D(wav, x, nx, ny, 1);
+  double* wav = arena_alloc(arena, nx * ny * sizeof(double));
+  fwt97_2D(wav, x, nx, ny, cdf_levels, arena);
   double reg = L1(wav, NULL, 0, nx, ny, 1.);
-  free(wav);
+  arena_free(arena, wav);
   return reg;
 }
 
 
-
 void atrous_set(int idx) // set the wavelet coefficients for the a trous algorithm
 {
 	static float d1_lin3[3] = { 0.25, 0.5, 0.25 };
@@ -742,54 +1021,134 @@ int mpower(int basis, int exponent) {
 	return result;
 }
 
+float atrous_smooth(const double *x, const int i, const int j, const int nx, const int ny, const int istep)
+{
+	// x convolved with the filter dilated by istep at pixel (i, j), accumulated in single precision
+	int i2, j2, i3, j3;
+	const int nf = atrous_2d_filter.ncof;
+	const int nc = atrous_2d_filter.ioff;
+	float smooth = 0.;
+	for (i2 = 0; i2 < nf; i2++)
+	{
+		i3 = i + (i2 - nc) * istep;
+		// wrap around edges, using periodic boundary conditions
+		i3 = (i3 >= 0 ? (i3 < nx ? i3 : i3 - nx) : i3 + nx);
+		for (j2 = 0; j2 < nf; j2++)
+		{
+			j3 = j + (j2 - nc) * istep;
+			// wrap around edges, using periodic boundary conditions
+			j3 = (j3 >= 0 ? (j3 < ny ? j3 : j3 - ny) : j3 + ny);
+			smooth += atrous_2d_filter.cc[i2 * nf + j2] * x[j3 * nx + i3];
+		}
+	}
+	return smooth;
+}
+
 void atrous_fwd(const double* x, double *wav, const int nx, const int ny, const int nscales)
 {
-	int i, j, i2, j2, i3, j3, k, nf, nc, istep;
-	nf = atrous_2d_filter.ncof;
-	nc = atrous_2d_filter.ioff;
+	int i, j, k, istep;
 	int n = nx * ny;
 
-	// forward transform
-	float *storage = malloc(sizeof(float) * n);
-	for (i = 0; i < n; i++) // copy initial image - set as first scale
-		storage[i] = x[i];
-
+	// forward transform, every scale k > 0 holds the details of the image at its step, wav[0] the image smoothed at the largest step
 	for (k = nscales - 1; k > 0; k--)
-	  { // determine step size for convolution depending on resolution scale
+	{ // determine step size for convolution depending on resolution scale, starting with large k (small scales)
+		istep = 1 << (nscales - 1 - k);
+		for (i = 0; i < nx; i++)
+			for (j = 0; j < ny; j++)
+			{
+				const float smooth = atrous_smooth(x, i, j, nx, ny, istep);
+				// construct detail coefficients by subtraction of smoothed image
+				wav[k * n + j * nx + i] = x[j * nx + i] - smooth;
+				if (k == 1)
+					wav[j * nx + i] = smooth;
+			}
+	}
+}
 
-	    istep = powf(2, nscales - 1 - k); // copy image to scale, starting with large k (small scales)
+int atrous_max_scales(const int nx, const int ny)
+{
+	// The largest step is 2^(nscales - 2), the filter reaches twice as far and may wrap around the image only once
+	int nscales = 2;
+	while ((nscales < 31) && ((1 << nscales) < nx) && ((1 << nscales) < ny))
+		nscales++;
+	return nscales;
+}
 
-		for (i = 0; i < n; i++)
-			wav[k * n + i] = x[i];
+size_t atrous_state_bytes(const int nx, const int ny, const int nscales)
+{
+	// Arena bytes taken by atrous_state_init
+	const long journal = 2 * nscales * atrous_2d_filter.ncof * atrous_2d_filter.ncof;
+	return arena_slice(nscales * nx * ny * sizeof(double)) + arena_slice(journal * sizeof(double *)) + arena_slice(journal * sizeof(double));
+}
 
-		// smooth image by convolution with filter
-		for (i = 0; i < nx; i++)
+void atrous_state_init(atrous_state *s, const int nx, const int ny, const int nscales, scratch_arena *arena)
+{
+	s->nx = nx;
+	s->ny = ny;
+	s->nscales = nscales;
+	s->wav = arena_alloc(arena, nscales * nx * ny * sizeof(double));
+	// a move rewrites, for each of the two pixels, one footprint per scale plus the smoothed image
+	journal_init(&s->journal, 2 * nscales * atrous_2d_filter.ncof * atrous_2d_filter.ncof, arena);
+}
+
+void atrous_state_free(atrous_state *s, scratch_arena *arena)
+{
+	journal_free(&s->journal, arena);
+	arena_free(arena, s->wav);
+}
+
+void atrous_state_full(atrous_state *s, const double *x)
+{
+	atrous_fwd(x, s->wav, s->nx, s->ny, s->nscales);
+}
+
+void atrous_pixel(atrous_state *s, const double *x, const int i, const int j, double *dL0, double *dL1)
+{
+	// Recomputes, at every scale, the coefficients whose dilated footprint covers pixel (i, j)
+	const int nf = atrous_2d_filter.ncof;
+	const int nc = atrous_2d_filter.ioff;
+	const int n = s->nx * s->ny;
+	int k, i2, j2, i3, j3, istep;
+	for (k = s->nscales - 1; k > 0; k--)
+	{
+		istep = 1 << (s->nscales - 1 - k);
+		for (i2 = 0; i2 < nf; i2++)
 		{
-			for (j = 0; j < ny; j++)
+			i3 = i - (i2 - nc) * istep;
+			i3 = (i3 >= 0 ? (i3 < s->nx ? i3 : i3 - s->nx) : i3 + s->nx);
+			for (j2 = 0; j2 < nf; j2++)
 			{
-				storage[j * nx + i] = 0.;
-				for (i2 = 0; i2 < nf; i2++)
+				j3 = j - (j2 - nc) * istep;
+				j3 = (j3 >= 0 ? (j3 < s->ny ? j3 : j3 - s->ny) : j3 + s->ny);
+				const float smooth = atrous_smooth(x, i3, j3, s->nx, s->ny, istep);
+				const double detail = x[j3 * s->nx + i3] - smooth;
+				sparsity_change(s->wav[k * n + j3 * s->nx + i3], detail, dL0, dL1);
+				journal_set(&s->journal, &s->wav[k * n + j3 * s->nx + i3], detail);
+				if (k == 1)
 				{
-					i3 = i + (i2 - nc) * istep;
-					// wrap around edges, using periodic boundary conditions
-					i3 = (i3 >= 0 ? (i3 < nx ? i3 : i3 - nx) : i3 + nx);
-					for (j2 = 0; j2 < nf; j2++)
-					{
-						j3 = j + (j2 - nc) * istep;
-						// wrap around edges, using periodic boundary conditions
-						j3 = (j3 >= 0 ? (j3 < ny ? j3 : j3 - ny) : j3 + ny);
-						storage[j * nx + i] += atrous_2d_filter.cc[i2 * nf + j2] * wav[k * n + j3 * nx + i3];
-					}
+					sparsity_change(s->wav[j3 * s->nx + i3], smooth, dL0, dL1);
+					journal_set(&s->journal, &s->wav[j3 * s->nx + i3], smooth);
 				}
 			}
 		}
-		for (i = 0; i < n; i++) // construct detail coefficients by subtraction of smoothed image
-			wav[k * n + i] -= storage[i];
-
-		for (i = 0; i < n; i++)
-			wav[i] = storage[i];
 	}
-	free(storage);
+}
+
+void atrous_state_move(atrous_state *s, const double *x, const int old_i, const int old_j, const int new_i, const int new_j, double *dL0, double *dL1)
+{
+	// x already holds the moved element, dL0 and dL1 get the changes of the L0 and L1 norms of the coefficients.
+	// The coefficients overwritten are journaled for atrous_state_undo
+	*dL0 = 0;
+	*dL1 = 0;
+	s->journal.n = 0;
+	atrous_pixel(s, x, old_i, old_j, dL0, dL1);
+	atrous_pixel(s, x, new_i, new_j, dL0, dL1);
+}
+
+void atrous_state_undo(atrous_state *s)
+{
+	// Back to the transform before the last atrous_state_move
+	journal_undo(&s->journal);
 }
 
 
@@ -888,25 +1247,53 @@ int a_trous(double **a, int nx, int ny, int nscales, int isign) {
 	return 0;
 }
 
-double L0_ATROUS(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux)
+size_t regularizer_state_bytes(const double *reg_param, const int nx, const int ny)
+{
+  // Arena footprint of the incremental states of one channel, kept for the whole run
+  size_t bytes = 0;
+  int c;
+  for (c = 0; c < NCDF; ++c)
+    if ((reg_param[cdf_regs[c][0]] > 0.0) || (reg_param[cdf_regs[c][1]] > 0.0))
+      bytes += cdf_state_bytes(nx, ny, cdf_levels, cdf_schemes[c]->nsteps);
+  if ((reg_param[REG_L0ATROUS] > 0.0) || (reg_param[REG_L1ATROUS] > 0.0))
+    bytes += atrous_state_bytes(nx, ny, atrous_scales);
+  return bytes;
+}
+
+size_t regularizer_scratch_bytes(const double *reg_param, const int nx, const int ny)
+{
+  // Largest arena footprint of the full regularizers computed by compute_regularizers, which run one at a time
+  size_t bytes = 0;
+  int c;
+  for (c = 0; c < NCDF; ++c)
+    if ((reg_param[cdf_regs[c][0]] > 0.0) || (reg_param[cdf_regs[c][1]] > 0.0))
+      if (arena_slice(nx * ny * sizeof(double)) + cdf_state_bytes(nx, ny, cdf_levels, cdf_schemes[c]->nsteps) > bytes)
+        bytes = arena_slice(nx * ny * sizeof(double)) + cdf_state_bytes(nx, ny, cdf_levels, cdf_schemes[c]->nsteps);
+  if ((reg_param[REG_L0ATROUS] > 0.0) || (reg_param[REG_L1ATROUS] > 0.0))
+    if (arena_slice(atrous_scales * nx * ny * sizeof(double)) > bytes)
+      bytes = arena_slice(atrous_scales * nx * ny * sizeof(double));
+  return bytes;
+}
+
+double L0_ATROUS(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux, scratch_arena *arena)
 {
-  const int nscales = 4;
-  double* wav = malloc( nscales * nx * ny * sizeof(double));
+  const int nscales = atrous_scales;
+  double* wav = arena_alloc(arena, nscales * nx * ny * sizeof(double));
   atrous_fwd(x, wav, nx, ny, nscales);
 // Take modulus for L1(pos) or L0
   for (int i = 0; i < nscales*nx*ny; ++i)
     wav[i] = fabs(wav[i]);
   double reg = L0(wav, NULL, 0, nscales*nx, ny, 1.);
-  free(wav);
+  arena_free(arena, wav);
   return reg;
 }
 
-double L1_ATROUS(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux)
+double L1_ATROUS(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux, scratch_arena *arena)
 {
-  const int nscales = 4;
-  double* wav = malloc( nscales * nx * ny * sizeof(double));
+  const int nscales = atrous_scales;
+  double* wav = arena_alloc(arena, nscales * nx * ny * sizeof(double));
   atrous_fwd(x, wav, nx, ny, nscales);
   double reg = L1(wav, NULL, 0, nscales*nx, ny, 1.);
-  free(wav);
+  arena_free(arena, wav);
   return reg;
 }
@@ -21,17 +21,26 @@
  *    along with Squeeze.  If not, see <http://www.gnu.org/licenses/>.
  *
  */
+#ifdef __linux__
+#define _GNU_SOURCE // sched_setaffinity, for -numa
+#include <unistd.h>
+#endif
+#include <sched.h>
 #ifdef _OPENMP
 #include <omp.h>
 #endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 #include <math.h>
 #include <assert.h>
 #include <signal.h>
 #include <time.h>
 #include <string.h>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 #include "../lib/rngstreams/src/RngStream.h"
 #include "squeeze.h"
 #include "../lib/oifitslib/src/oifitslib/exchange.h" // includes cfitio
@@ -62,16 +71,46 @@ double *__restrict uv_time;
 double *__restrict uv_lambda;
 double *__restrict uv_dlambda;
 int *uvwav2chan = NULL;
+long *chan_uv_start = NULL; // uv points of channel w are contiguous, chan_uv_start[w] <= j < chan_uv_start[w+1]
 int *uvtime2chan = NULL;
 double *__restrict data;
 double *__restrict data_err;
 
+/* Per-channel observable index (built by build_channel_index)             */
+/* Observables of channel w are xxx_chan_idx[xxx_chan_off[w] ... xxx_chan_off[w+1]-1] */
+/* Slot nwavr collects the observables whose uv points lie outside all channels */
+bool use_chan_likelihood = FALSE;
+bool use_early_rejection = TRUE; // stop evaluating chi2 once the pre-drawn Metropolis threshold is exceeded
+double phasor_memory_budget = DEFAULT_PHASOR_MEMORY; // MB, above this the phasor tables are replaced by on-the-fly generation
+double *xphasor_base = NULL; // on-the-fly phasors: per uv base phasors, see phasor_value
+double *yphasor_base = NULL;
+int mtm_tries = 1; // > 1: multiple-try Metropolis with mtm_tries candidates per element move
+bool use_float_phasors = FALSE; // element moves use single-precision phasor tables
+long vis_resync = 0; // > 0: every vis_resync iterations, recompute the visibilities from scratch to bound the incremental drift
+int chain_threads = 1; // threads of the team that splits the uv/observable loops of one chain
+long par_threshold = DEFAULT_PAR_THRESHOLD; // uv points or observables below which these loops stay serial
+int mpi_rank = 0, mpi_size = 1; // squeeze_mpi: this rank, and the number of ranks sharing the temperature ladder
+bool use_numa = FALSE; // replicate the phasor tables on each NUMA node and pin the chains to the cpus of their node
+long chain_quantum = DEFAULT_CHAIN_QUANTUM; // iterations a chain runs before handing its thread to a waiting chain
+bool use_adaptive_ladder = FALSE; // parallel tempering: tune the temperature spacing during burn-in
+bool use_deo_swaps = FALSE; // parallel tempering: deterministic even/odd pair schedule instead of random neighbours
+long total_round_trips = 0; // parallel tempering: round trips of the replicas between the coldest and hottest temperature
+double mean_round_trip = 0; // in iterations
+int nswap_pairs = 0; // parallel tempering: swap rate of each pair of adjacent temperatures, for the output header
+double *swap_rates = NULL;
+bool use_stepping_stone = FALSE; // parallel tempering: also estimate logZ with the stepping-stone estimator
+double logZ_ss = 0, logZ_ss_err = 0;
+long *v2_chan_off = NULL, *t3_chan_off = NULL, *visamp_chan_off = NULL, *visphi_chan_off = NULL;
+long *v2_chan_idx = NULL, *t3_chan_idx = NULL, *visamp_chan_idx = NULL, *visphi_chan_idx = NULL;
+
 /* Parametric Model Fitting*/
 long nparams;
 double init_params[MAX_PARAMS], init_stepsize[MAX_PARAMS];
 
 /* Wavelet definitions */
 wavefilt atrous_1d_filter, atrous_2d_filter;
+int cdf_levels = 1; // decomposition levels of the CDF 5/3 and 9/7 wavelet regularizers
+int atrous_scales = 4; // scales of the a trous wavelet regularizers, the smoothed image included
 
 /* SQUEEZE MAIN LOOP */
 int main(int argc, char **argv)
@@ -174,8 +213,32 @@ int main(int argc, char **argv)
   // First check if nchains and nthreads have been set
   if (nchains == 0)
     nchains = 1;
+#ifdef SQUEEZE_MPI
+  int mpi_thread_support;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &mpi_thread_support); // chains exchange across ranks from their own threads
+  MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
+  if (mpi_rank > 0)
+    if (freopen("/dev/null", "w", stdout) == NULL) // rank 0 reports for all
+      printf("Threading    -- Rank %d could not silence its output\n", mpi_rank);
+  if ((mpi_thread_support < MPI_THREAD_MULTIPLE) || (minimization_engine != ENGINE_PARALLEL_TEMPERING) || ((nchains % mpi_size) != 0))
+  {
+    printf("Threading    -- squeeze_mpi needs MPI_THREAD_MULTIPLE, -tempering, and a number of chains divisible by the %d ranks\n", mpi_size);
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+  nchains /= mpi_size; // from here on, the chains of this rank
+  // each rank draws from its own random streams
+  for (k = 0; k < mpi_rank * (nchains + RANK_RNG_STREAMS); ++k)
+  {
+    RngStream skiprng = RngStream_CreateStream("skip");
+    RngStream_DeleteStream(&skiprng);
+  }
+  printf("Threading    -- MPI ranks: %d, each with %d chains\n", mpi_size, nchains);
+#endif
 #ifdef _OPENMP
   nmaxthreads = omp_get_max_threads() / 2;
+  if (nmaxthreads < 1)
+    nmaxthreads = 1; // one CPU, or OMP_NUM_THREADS=1 as for squeeze_mpi ranks: the chain gate needs a thread to hand out
 #else
   nmaxthreads = 1;
 #endif
@@ -185,8 +248,8 @@ int main(int argc, char **argv)
 
   if (nthreads > nmaxthreads)
   {
-    nthreads = nmaxthreads;
     printf("Command line -- Requested number of threads: %d is greater than physically available: %d\n", nthreads, nmaxthreads);
+    nthreads = nmaxthreads;
   }
 
   // compute the resulting number of threads within each chain
@@ -197,9 +260,25 @@ int main(int argc, char **argv)
   printf("Threading    -- Number of Chains: %d\n", nchains);
   printf("Threading    -- Number of OS threads: %d out of %d possible maximum\n", nthreads, nmaxthreads);
   printf("Threading    -- Number of OS threads per chain that may be used: %d\n", nthreadsperchain);
+#ifdef _OPENMP
+  if (nchains > nthreads)
+    printf("Threading    -- %d chains share %d threads, switching every %ld iterations\n", nchains, nthreads, chain_quantum);
+#endif
+
+  // Chains with more than one thread split their large uv/observable loops across a nested team
+  chain_threads = nthreadsperchain;
+#ifdef _OPENMP
+  if (chain_threads > 1)
+  {
+    omp_set_max_active_levels(2);
+    printf("Threading    -- Intra-chain loops split above %ld uv points or observables\n", par_threshold);
+  }
+#else
+  chain_threads = 1;
+#endif
 
   // If we want to use parallel tempering but no threads are defined,
-  if ((minimization_engine == ENGINE_PARALLEL_TEMPERING) && ((nchains == 1) || (nthreads == 1)))
+  if ((minimization_engine == ENGINE_PARALLEL_TEMPERING) && ((nchains * mpi_size == 1) || ((nthreads == 1) && (mpi_size == 1))))
   {
     printf("Threading    -- Parallel tempering requested but the requested number of chains is %d\n", nchains);
     printf("Threading    -- Please restart SQUEEZE and set this number accordingly.\n");
@@ -227,6 +306,9 @@ int main(int argc, char **argv)
   }
   fflush(stdout);
 
+  /* Index the observables by reconstruction channel */
+  build_channel_index(nwavr);
+
   /* Initialise default values...(use multx,multy as temp variables)*/
   /* Find longest (multx) and shortest (multy) baselines */
   for (i = 0; i < nuv; ++i)
@@ -617,41 +699,158 @@ int main(int argc, char **argv)
   fflush(stdout);
 
   /* Now make big matrix - we'll just make this a big chunk of
-   *    memory. */
-  double complex
-  * __restrict xtransform = malloc(axis_len * nuv * sizeof(double complex));
-  double complex
-  * __restrict ytransform = malloc(axis_len * nuv * sizeof(double complex));
-  for (k = 0; k < nuv; k++)
+   *    memory. Each row is split into real and imaginary halves (see PHASOR_RE/PHASOR_IM) */
+  double
+  * __restrict xtransform = NULL;
+  double
+  * __restrict ytransform = NULL;
+  double complex xphasor, yphasor;
+  const double phasor_table_mb = 2. * 2. * axis_len * nuv * sizeof(double) / 1048576.;
+
+  if (phasor_table_mb > phasor_memory_budget)
+  {
+    // Tables too large: only keep the base phasors, element moves generate their columns by integer powers
+    printf("Reconst setup -- Phasor tables:\t\ton the fly (%.1lf MB needed, budget %.1lf MB)\n", phasor_table_mb, phasor_memory_budget);
+    xphasor_base = malloc(PHASOR_BASE_ROWS * nuv * sizeof(double));
+    yphasor_base = malloc(PHASOR_BASE_ROWS * nuv * sizeof(double));
+    for (k = 0; k < nuv; k++)
+    {
+      set_phasor_base(xphasor_base, k, 2.0 * M_PI * u[k] * mas_pixel / MAS_RAD,
+                      (use_bandwidthsmearing == TRUE) ? uv_dlambda[k] / uv_lambda[k] * u[k] * mas_pixel / MAS_RAD : 0.);
+      set_phasor_base(yphasor_base, k, 2.0 * M_PI * -v[k] * mas_pixel / MAS_RAD,
+                      (use_bandwidthsmearing == TRUE) ? uv_dlambda[k] / uv_lambda[k] * v[k] * mas_pixel / MAS_RAD : 0.);
+    }
+    if (use_float_phasors == TRUE)
+    {
+      printf("Reconst setup -- Single-precision phasors need the tables, disabled\n");
+      use_float_phasors = FALSE;
+    }
+  }
+  else
+  {
+    xtransform = malloc(2 * axis_len * nuv * sizeof(double));
+    ytransform = malloc(2 * axis_len * nuv * sizeof(double));
+  }
+
+  for (k = 0; (xtransform != NULL) && (k < nuv); k++)
   {
     // dtemp = exp ( -M_PI * M_PI / 4.0 / log ( 2 ) * ( u[k] * u[k] + v[k] * v[k] ) / MAS_RAD / MAS_RAD  * ( cvfwhm * cvfwhm ) );
 
-    if (use_bandwidthsmearing == TRUE)
+    for (j = 0; j < axis_len; ++j)
     {
-      for (j = 0; j < axis_len; ++j)
+      xphasor = cexp(I * (j - axis_len / 2) * 2.0 * M_PI * u[k] * mas_pixel / MAS_RAD);
+      yphasor = cexp(I * (j - axis_len / 2) * 2.0 * M_PI * -v[k] * mas_pixel / MAS_RAD);
+      if (use_bandwidthsmearing == TRUE)
       {
-        xtransform[j * nuv + k] = sinc(uv_dlambda[k] / uv_lambda[k] * (j - axis_len / 2) * u[k] * mas_pixel / MAS_RAD)
-                                  * cexp(I * (j - axis_len / 2) * 2.0 * M_PI * u[k] * mas_pixel / MAS_RAD);
-        ytransform[j * nuv + k] = sinc(uv_dlambda[k] / uv_lambda[k] * (j - axis_len / 2) * v[k] * mas_pixel / MAS_RAD)
-                                  * cexp(I * (j - axis_len / 2) * 2.0 * M_PI * -v[k] * mas_pixel / MAS_RAD);
+        xphasor *= sinc(uv_dlambda[k] / uv_lambda[k] * (j - axis_len / 2) * u[k] * mas_pixel / MAS_RAD);
+        yphasor *= sinc(uv_dlambda[k] / uv_lambda[k] * (j - axis_len / 2) * v[k] * mas_pixel / MAS_RAD);
       }
+      PHASOR_RE(xtransform, j, k) = creal(xphasor);
+      PHASOR_IM(xtransform, j, k) = cimag(xphasor);
+      PHASOR_RE(ytransform, j, k) = creal(yphasor);
+      PHASOR_IM(ytransform, j, k) = cimag(yphasor);
+    }
+  }
+
+  // Single-precision copies for the element move loop, the double tables remain the reference
+  float *__restrict xtransform_f = NULL;
+  float *__restrict ytransform_f = NULL;
+  if (use_float_phasors == TRUE)
+  {
+    xtransform_f = malloc(2 * axis_len * nuv * sizeof(float));
+    ytransform_f = malloc(2 * axis_len * nuv * sizeof(float));
+    for (k = 0; k < 2 * axis_len * nuv; k++)
+    {
+      xtransform_f[k] = (float) xtransform[k];
+      ytransform_f[k] = (float) ytransform[k];
+    }
+    printf("Reconst setup -- Single-precision phasors:\tenabled\n");
+  }
+  if (vis_resync > 0)
+    printf("Reconst setup -- Visibility resync:\tevery %ld iterations\n", vis_resync);
+
+  if (mtm_tries > 1)
+  {
+    // candidates are evaluated on the double phasor tables and the channel-local likelihood only
+    if ((use_chan_likelihood == FALSE) || (xtransform == NULL) || (use_float_phasors == TRUE))
+    {
+      printf("Reconst setup -- Multiple-try Metropolis needs double phasor tables and channel-local likelihood, disabled\n");
+      mtm_tries = 1;
+    }
+    else
+      printf("Reconst setup -- Multiple-try Metropolis:\t%d candidates per element move\n", mtm_tries);
+  }
+
+  if ((reg_param[REG_L0CDF53] > 0.0) || (reg_param[REG_L1CDF53] > 0.0) || (reg_param[REG_L0CDF97] > 0.0) || (reg_param[REG_L1CDF97] > 0.0))
+  {
+    if (cdf_max_levels(axis_len, axis_len) == 0)
+    {
+      printf("Reconst setup -- CDF wavelets need an even image width, disabled\n");
+      reg_param[REG_L0CDF53] = reg_param[REG_L1CDF53] = reg_param[REG_L0CDF97] = reg_param[REG_L1CDF97] = 0.0;
     }
     else
     {
-      for (j = 0; j < axis_len; ++j)
-      {
+      if (cdf_levels > cdf_max_levels(axis_len, axis_len))
+        cdf_levels = cdf_max_levels(axis_len, axis_len); // the low-pass quadrant has to keep even sides
+      printf("Reconst setup -- CDF wavelet levels:\t%d\n", cdf_levels);
+    }
+  }
+
+  if ((reg_param[REG_L0ATROUS] > 0.0) || (reg_param[REG_L1ATROUS] > 0.0))
+  {
+    if (atrous_scales > atrous_max_scales(axis_len, axis_len))
+      atrous_scales = atrous_max_scales(axis_len, axis_len); // the dilated filter may wrap around the image only once
+    printf("Reconst setup -- A trous wavelet scales:\t%d\n", atrous_scales);
+  }
 
-        xtransform[j * nuv + k] = cexp(I * (j - axis_len / 2) * 2.0 * M_PI * u[k] * mas_pixel / MAS_RAD);
-        ytransform[j * nuv + k] = cexp(I * (j - axis_len / 2) * 2.0 * M_PI * -v[k] * mas_pixel / MAS_RAD);
+  // NUMA: one first-touched copy of the read-only phasor tables per node, chains are pinned next to theirs
+  numa_topology topo = { .nnodes = 1 };
+  double **node_xtransform = NULL, **node_ytransform = NULL;
+  float **node_xtransform_f = NULL, **node_ytransform_f = NULL;
+#ifdef _OPENMP
+  if (use_numa == TRUE)
+  {
+    read_numa_topology(&topo);
+    printf("Threading    -- NUMA nodes: %d\n", topo.nnodes);
+    for (i = 0; i < topo.nnodes; ++i)
+      printf("Threading    -- NUMA node %ld: %d cpus (%d to %d), chains %ld, %ld, ...\n", i, topo.node_start[i + 1] - topo.node_start[i], topo.cpus[topo.node_start[i]],
+             topo.cpus[topo.node_start[i + 1] - 1], i, i + topo.nnodes);
+    if ((topo.nnodes > 1) && (xtransform != NULL))
+    {
+      node_xtransform = calloc(topo.nnodes, sizeof(double *));
+      node_ytransform = calloc(topo.nnodes, sizeof(double *));
+      node_xtransform_f = calloc(topo.nnodes, sizeof(float *));
+      node_ytransform_f = calloc(topo.nnodes, sizeof(float *));
+      #pragma omp parallel for num_threads(topo.nnodes) schedule(static, 1)
+      for (i = 0; i < topo.nnodes; ++i)
+      {
+        // pages land on the node of the first thread writing them
+        pin_thread(&topo.cpus[topo.node_start[i]], topo.node_start[i + 1] - topo.node_start[i]);
+        node_xtransform[i] = malloc(2 * axis_len * nuv * sizeof(double));
+        node_ytransform[i] = malloc(2 * axis_len * nuv * sizeof(double));
+        memcpy(node_xtransform[i], xtransform, 2 * axis_len * nuv * sizeof(double));
+        memcpy(node_ytransform[i], ytransform, 2 * axis_len * nuv * sizeof(double));
+        if (xtransform_f != NULL)
+        {
+          node_xtransform_f[i] = malloc(2 * axis_len * nuv * sizeof(float));
+          node_ytransform_f[i] = malloc(2 * axis_len * nuv * sizeof(float));
+          memcpy(node_xtransform_f[i], xtransform_f, 2 * axis_len * nuv * sizeof(float));
+          memcpy(node_ytransform_f[i], ytransform_f, 2 * axis_len * nuv * sizeof(float));
+        }
       }
+      pin_thread(topo.cpus, topo.node_start[topo.nnodes]); // the master thread may run anywhere again
+      printf("Threading    -- Phasor tables replicated on each node (%.1lf MB per node)\n", phasor_table_mb * ((xtransform_f != NULL) ? 1.5 : 1.));
     }
   }
+#endif
 
   // Shared OpenMP memory
 
   unsigned int *burn_in_times = calloc(nchains, sizeof(unsigned int));
   double *lLikelihood_expectation = calloc(nchains, sizeof(double));
   double *lLikelihood_deviation = calloc(nchains, sizeof(double));
+  lLikelihood_accumulator *lLikelihood_accumulators = cache_aligned_calloc(nchains, sizeof(lLikelihood_accumulator)); // per storage, after burn-in
+  chain_context *chain_contexts = cache_aligned_calloc(nchains, sizeof(chain_context));
   double *saved_lLikelihood = calloc(nchains * niter, sizeof(double));
   double *saved_lPosterior = calloc(nchains * niter, sizeof(double));
   double *saved_lPrior = calloc(nchains * niter, sizeof(double));
@@ -665,10 +864,62 @@ int main(int argc, char **argv)
   // of the i-st lowest temperature
   unsigned short *iStoragetoChain = calloc(nchains, sizeof(unsigned short)); // determines where each storage/temperature is ; converse of iChaintoStorage
 
-  unsigned short *iMovedChain = calloc(nchains, sizeof(unsigned short));
+  swap_slot *swap_slots = cache_aligned_calloc(nchains, sizeof(swap_slot)); // nchains - 1 pairs of adjacent temperatures
+  long *round_trips = calloc(nchains, sizeof(long)); // per replica, with their summed duration in iterations
+  long *round_trip_iterations = calloc(nchains, sizeof(long));
+  const double log_tmax = tempschedc * log((double) nchains); // highest temperature, also kept by the adaptive ladder
+  if ((minimization_engine == ENGINE_PARALLEL_TEMPERING) && (use_adaptive_ladder == TRUE))
+  {
+    if (mpi_size > 1)
+    {
+      printf("Reconst setup -- The adaptive temperature ladder is not available across MPI ranks, disabled\n");
+      use_adaptive_ladder = FALSE;
+    }
+    else if (tempschedc > 0)
+    {
+      init_ladder(swap_slots, nchains, tempschedc);
+      printf("Reconst setup -- Adaptive temperature ladder until iteration %ld\n", (long) ceil(0.3 * niter));
+    }
+    else
+      use_adaptive_ladder = FALSE;
+  }
+
+  // Population annealing: the whole population cools to T = 1 over the first 30% of the iterations, then samples
+  const long anneal_end = ceil(0.3 * niter);
+  double population_tstart = 1, population_logZ = 0, population_logZ_var = 0;
+  bool population_stop = FALSE; // Ctrl-C seen at a step, all chains stop there
+  population_replica *population = NULL;
+  double *population_lLikelihood = NULL;
+  int *population_ancestor = NULL;
+  RngStream population_rng = NULL;
+  if (minimization_engine == ENGINE_POPULATION_ANNEALING)
+  {
+    population_tstart = fmax(FLAT_CHI2_MULT * flat_chi2 / ndf, 1.0);
+    population = calloc(nchains, sizeof(population_replica));
+    population_lLikelihood = calloc(nchains, sizeof(double));
+    population_ancestor = calloc(nchains, sizeof(int));
+    population_rng = RngStream_CreateStream("population");
+    printf("Reconst setup -- Population annealing of %d replicas from T = %f to T = 1 until iteration %ld\n", nchains, population_tstart, anneal_end);
+  }
 
   for (i = 0; i < nchains; ++i)
-    burn_in_times[i] = niter; // for ENGINE_SIMULATED_ANNEALING, unless T gets to tmin, burn-in is never achieved
+    burn_in_times[i] = (minimization_engine == ENGINE_POPULATION_ANNEALING) ? anneal_end : niter; // for ENGINE_SIMULATED_ANNEALING, unless T gets to tmin, burn-in is never achieved
+
+#ifdef _OPENMP
+  bool gate_chains = (nchains > nthreads); // more chains than threads: chains take turns on the threads
+  chain_gate gate;
+  if ((gate_chains == TRUE) && (chain_gate_init(&gate, nchains, nthreads) == FALSE))
+  {
+    printf("Threading    -- Could not set up the chain run queue, all %d chains run at once\n", nchains);
+    gate_chains = FALSE;
+  }
+#endif
+
+#ifdef _OPENMP
+  double sampling_time = omp_get_wtime(); // wall time of the chains, for the round trip rate
+#else
+  double sampling_time = (double) clock() / CLOCKS_PER_SEC;
+#endif
 
 #ifdef _OPENMP
   omp_set_num_threads(nchains);
@@ -677,12 +928,14 @@ int main(int argc, char **argv)
   // Start nchains MCMC
   //
   #pragma omp parallel private(i,j,k,w) \
-  shared(temperature, iChaintoStorage, iStoragetoChain, iMovedChain, burn_in_times, saved_x, saved_y, saved_lLikelihood, \
+  shared(gate, gate_chains, chain_contexts, temperature, iChaintoStorage, iStoragetoChain, swap_slots, log_tmax, round_trips, round_trip_iterations, burn_in_times, saved_x, saved_y, saved_lLikelihood, \
          saved_lPosterior, saved_lPrior, saved_params, saved_reg_value, minimization_engine, use_tempfitswriting,init_filename, \
          ctrlcpressed, f_anywhere, f_copycat, prob_auto, tmin, chi2_target, mas_pixel, niter, chi2_temp, flat_chi2, \
-         axis_len, lLikelihood_expectation, lLikelihood_deviation , nwavr, nelements, nchains, tempschedc, \
-         uvwav2chan, uvtime2chan, nuv,nv2,nt3amp,nt3phi,nvisamp,nvisphi,init_params,init_stepsize,initial_x,initial_y, \
-         reg_param, prior_image,cent_mult,fov,nparams,xtransform,ytransform, ndf)
+         axis_len, lLikelihood_expectation, lLikelihood_deviation, lLikelihood_accumulators, nwavr, nelements, nchains, tempschedc, \
+         uvwav2chan, chan_uv_start, uvtime2chan, nuv,nv2,nt3amp,nt3phi,nvisamp,nvisphi,init_params,init_stepsize,initial_x,initial_y, \
+         reg_param, prior_image,cent_mult,fov,nparams,xtransform,ytransform,xtransform_f,ytransform_f, ndf, \
+         topo, node_xtransform, node_ytransform, node_xtransform_f, node_ytransform_f, anneal_end, population_tstart, population_logZ, \
+         population_logZ_var, population_stop, population, population_lLikelihood, population_ancestor, population_rng)
 #endif
   {
     /* The current system state */
@@ -698,17 +951,69 @@ int main(int argc, char **argv)
     //getchar();
     if (minimization_engine == ENGINE_SIMULATED_ANNEALING)
       temperature[iChain] = 1.0;
+    else if (minimization_engine == ENGINE_POPULATION_ANNEALING)
+      temperature[iChain] = population_tstart;
     else
     {
-      temperature[iChain] = pow(((double) nchains) / (1.0 * (nchains - iChain)), tempschedc); // T[0] = 1, T[nchains-1] = nchains^tempschedc
-      printf("Reconst setup -- Chain %d has temperature %f\n", iChain, temperature[iChain]);
+      // T[0] = 1, T[nchains-1] = nchains^tempschedc, over the whole ladder with MPI
+      temperature[iChain] = pow(((double) nchains * mpi_size) / (1.0 * (nchains * mpi_size - mpi_rank * nchains - iChain)), tempschedc);
+      printf("Reconst setup -- Chain %d has temperature %f\n", mpi_rank * nchains + iChain, temperature[iChain]);
     }
     #pragma omp barrier
+#ifdef _OPENMP
+    if (gate_chains == TRUE)
+      chain_gate_enter(&gate, iChain); // wait for a free thread
+#endif
+
+    // Phasor tables read by this chain, the copy of its NUMA node with -numa
+    const double *chain_xtransform = xtransform, *chain_ytransform = ytransform;
+    const float *chain_xtransform_f = xtransform_f, *chain_ytransform_f = ytransform_f;
+#ifdef _OPENMP
+    if (use_numa == TRUE)
+    {
+      const int node = iChain % topo.nnodes, node_ncpus = topo.node_start[node + 1] - topo.node_start[node];
+      const int *node_cpus = &topo.cpus[topo.node_start[node]];
+      // a chain gets chain_threads cores of its node, its nested team inherits them. Chains taking turns share the whole node
+      const int first_cpu = (gate_chains == TRUE) ? 0 : (iChain / topo.nnodes * chain_threads) % node_ncpus;
+      const int ncpus = (gate_chains == TRUE) ? node_ncpus : ((chain_threads < node_ncpus - first_cpu) ? chain_threads : node_ncpus - first_cpu);
+      if (pin_thread(&node_cpus[first_cpu], ncpus) == TRUE)
+        printf("Reconst setup -- Chain %d pinned to cpus %d to %d on NUMA node %d\n", iChain, node_cpus[first_cpu], node_cpus[first_cpu + ncpus - 1], node);
+      if (node_xtransform != NULL)
+      {
+        chain_xtransform = node_xtransform[node];
+        chain_ytransform = node_ytransform[node];
+        chain_xtransform_f = node_xtransform_f[node];
+        chain_ytransform_f = node_ytransform_f[node];
+      }
+    }
+#endif
 
     iChaintoStorage[iChain] = iChain; // initally, the storage unit for chain N is saved_xxx[N * ...],
     iStoragetoChain[iChain] = iChain; // initally,  storage[N] has temperature[N]
-    iMovedChain[iChain] = 0; // no threads have been moved
 
+    long uv_start = 0, uv_end = 0; // range of uv points touched by the current proposal
+    double chi2_bound, chi2_others, chi2_partial; // early rejection
+    double *move_xrows = NULL, *move_yrows = NULL; // on-the-fly phasors: new/old columns of the current element move
+    if (chain_xtransform == NULL)
+    {
+      move_xrows = malloc(2 * 2 * nuv * sizeof(double));
+      move_yrows = malloc(2 * 2 * nuv * sizeof(double));
+    }
+    // Multiple-try Metropolis: candidate positions, reference positions, log weights and candidate visibilities
+    unsigned short mtm_x[MTM_MAX_TRIES], mtm_y[MTM_MAX_TRIES], mtm_ref_x[MTM_MAX_TRIES], mtm_ref_y[MTM_MAX_TRIES];
+    double mtm_lw[MTM_MAX_TRIES], mtm_ref_lw[MTM_MAX_TRIES], mtm_max_lw, mtm_sum, mtm_ref_sum, mtm_u;
+    bool mtm_step = FALSE, mtm_accept = FALSE;
+    long mtm_select;
+    double complex *mtm_vis = NULL;
+    double *mtm_reg_value = NULL;
+    if (mtm_tries > 1)
+    {
+      mtm_vis = malloc(mtm_tries * nuv * sizeof(double complex));
+      mtm_reg_value = malloc(nwavr * NREGULS * sizeof(double));
+    }
+    double vis_drift, resync_drift, max_vis_drift = 0; // largest |im_vis| error found at resync
+    double chi2_correction, max_chi2_correction = 0;
+    long nresync = 0;
     long chan = 0, rlong, xstep = 0, ystep = 0, steptype = STEP_MEDIUM;
     unsigned short new_x = 0, new_y = 0, old_x = 0, old_y = 0;
     long old_pos = 0, new_pos = 0;
@@ -741,18 +1046,26 @@ int main(int argc, char **argv)
     double *new_params = malloc(MAX_PARAMS * sizeof(double));
     double *stepsize = malloc(MAX_PARAMS * sizeof(double));
     double *prob_pmovement = malloc(MAX_PARAMS * sizeof(double));
-    double *res = malloc((nv2 + nt3amp + nt3phi + nvisamp + nvisphi) * sizeof(double)); // current residuals
-    double *mod_obs = malloc((nv2 + nt3amp + nt3phi + nvisamp + nvisphi) * sizeof(double)); // current observables
+    double *chi2_chan = malloc((nwavr + 1) * NCHI2 * sizeof(double)); // current chi2 partials, per channel
+    double *new_chi2_chan = malloc((nwavr + 1) * NCHI2 * sizeof(double)); // proposed chi2 partials, per channel
     double *centroid_image_x = malloc(nwavr * sizeof(double));
     double *centroid_image_y = malloc(nwavr * sizeof(double));
     double *reg_value = malloc(nwavr * NREGULS * sizeof(double));
     double *new_reg_value = malloc(nwavr * NREGULS * sizeof(double));
     double *fluxratio_image = malloc(nuv * sizeof(double));
     double *new_fluxratio_image = malloc(nuv * sizeof(double));
-    unsigned short chain1, chain2;
+    edge_stats *edge_stat = malloc(nwavr * sizeof(edge_stats)); // EDGE threshold statistics of the current image, per channel
+    cdf_state *cdf = calloc(nwavr * NCDF, sizeof(cdf_state)); // CDF transforms of the current image, per channel, for those regularized
+    atrous_state *atrous = calloc(nwavr, sizeof(atrous_state)); // a trous transforms of the current image, per channel, if regularized
+    scratch_arena arena; // incremental regularizer states, temporaries of the full regularizers and of the population annealing step
+    arena_init(&arena, nwavr * regularizer_state_bytes(reg_param, axis_len, axis_len) + regularizer_scratch_bytes(reg_param, axis_len, axis_len) + arena_slice(nchains * sizeof(double)) + arena_slice(nchains * sizeof(int)));
+    long arena_nheap;
+    unsigned short chain1;
+    swap_pending pending_swap = { .pair = -1 };
+    int trip_end = -1; // last extreme temperature visited by this replica: -1 none, 0 coldest, 1 hottest
+    long trip_start = 0;
     double logZ = 0; // chose to have logZ to be a private variable
     double logZ_err = 0;
-    bool zerostep; // move selection
     double temp1 = 0, temp2=0;
     // Randomization
 
@@ -762,7 +1075,7 @@ int main(int argc, char **argv)
 
     /* Initialize the filename for temporarily saving*/
     char temp_filename[80];
-    sprintf(temp_filename, "chain%02d", iChain);
+    sprintf(temp_filename, "chain%02d", mpi_rank * nchains + iChain);
 
     for (w = 0; w < nwavr; ++w)
     {
@@ -797,21 +1110,42 @@ int main(int argc, char **argv)
     // INITIALIZE IMAGE
     //
     initialize_image(iChain, image, element_x, element_y, initial_x, initial_y, axis_len, nwavr, nelements, &init_filename[0]);
+    for (w = 0; w < nwavr; ++w)
+    {
+      edge_stats_full(&edge_stat[w], &image[w * axis_len * axis_len], axis_len * axis_len);
+      for (int c = 0; c < NCDF; ++c)
+        if ((reg_param[cdf_regs[c][0]] > 0.0) || (reg_param[cdf_regs[c][1]] > 0.0))
+        {
+          cdf_state_init(&cdf[w * NCDF + c], cdf_schemes[c], axis_len, axis_len, cdf_levels, &arena);
+          cdf_state_full(&cdf[w * NCDF + c], &image[w * axis_len * axis_len]);
+        }
+      if ((reg_param[REG_L0ATROUS] > 0.0) || (reg_param[REG_L1ATROUS] > 0.0))
+      {
+        atrous_state_init(&atrous[w], axis_len, axis_len, atrous_scales, &arena);
+        atrous_state_full(&atrous[w], &image[w * axis_len * axis_len]);
+      }
+    }
 
     //
     // COMPUTE INITIAL REGULARIZER VALUE
     //
 
     compute_regularizers(reg_param, reg_value, image, prior_image, (double) nelements, initial_x, initial_y, nwavr, axis_len, nelements, centroid_image_x,
-                         centroid_image_y, fov, cent_mult);
+                         centroid_image_y, fov, cent_mult, &arena);
     //
     // COMPUTE INITIAL VISIBILITIES
     //
-    compute_model_visibilities_fromelements(mod_vis, im_vis, param_vis, params, fluxratio_image, element_x, element_y, xtransform, ytransform,
-                                            &reg_value[REG_MODELPARAM], nparams, nelements);
+    compute_model_visibilities_fromelements(mod_vis, im_vis, param_vis, params, fluxratio_image, element_x, element_y, chain_xtransform, chain_ytransform,
+                                            &reg_value[REG_MODELPARAM], nparams, nelements, axis_len);
+    // Proposals only rewrite the uv range they touch, the rest of new_im_vis/new_mod_vis must mirror the current state
+    memcpy(new_im_vis, im_vis, nuv * sizeof(double complex));
+    memcpy(new_mod_vis, mod_vis, nuv * sizeof(double complex));
 
     //Compute initial values for prior, likelihood, and posterior
-    compute_lLikelihood(&lLikelihood, mod_vis, res, mod_obs, &chi2v2, &chi2t3amp, &chi2visamp, &chi2t3phi, &chi2visphi, nwavr);
+    for (w = 0; w < nwavr + 1; ++w)
+      compute_chi2_chan(&chi2_chan[w * NCHI2], mod_vis, w, nwavr);
+    memcpy(new_chi2_chan, chi2_chan, (nwavr + 1) * NCHI2 * sizeof(double));
+    lLikelihood = 0.5 * sum_chi2_chan(chi2_chan, nwavr, &chi2v2, &chi2t3amp, &chi2visamp, &chi2t3phi, &chi2visphi);
     compute_lPrior_allwav(&lPrior, nwavr, reg_param, reg_value);
     lPosterior = lLikelihood + lPrior;
     if (squeeze_quiet == FALSE) print_diagnostics(iChain, -1, nvis, nv2, nt3, nt3phi, nt3amp, nvisamp, nvisphi, chi2v2, chi2t3amp, chi2t3phi,
@@ -833,19 +1167,62 @@ int main(int argc, char **argv)
         burn_in_times[iChain] = niter / BURN_IN_FRAC;
       }
     }
+    chain_context *ctx = &chain_contexts[iChain];
+    ctx->temperature = temperature[iChain];
+    ctx->burn_in_time = burn_in_times[iChain];
+    arena_nheap = arena.nheap;
 
     /*--------------------------
      *    This is the main loop...
      *    ----------------------------*/
     for (i = 0; i < niter * nwavr * nelements; ++i)
     {
+#ifdef _OPENMP
+      if ((gate_chains == TRUE) && (i > 0) && ((i % (chain_quantum * nwavr * nelements)) == 0))
+        chain_gate_yield(&gate, iChain); // let a waiting chain run its quantum
+#endif
+
       //  new regularizer values
       for (w = 0; w < nwavr; ++w)
         for (j = 0; j < NREGULS; ++j)
           new_reg_value[w * NREGULS + j] = reg_value[w * NREGULS + j];
 
+      // Recompute the visibilities from scratch in double to bound the drift of the incremental updates
+      if ((vis_resync > 0) && (i > 0) && ((i % (vis_resync * nwavr * nelements)) == 0))
+      {
+        compute_model_visibilities_fromelements(new_mod_vis, new_im_vis, new_param_vis, params, new_fluxratio_image, element_x, element_y, chain_xtransform, chain_ytransform,
+                                                &new_reg_value[REG_MODELPARAM], nparams, nelements, axis_len);
+        resync_drift = 0;
+        for (j = 0; j < nuv; ++j)
+        {
+          vis_drift = cabs(new_im_vis[j] - im_vis[j]);
+          if (vis_drift > resync_drift)
+            resync_drift = vis_drift;
+        }
+        memcpy(im_vis, new_im_vis, nuv * sizeof(double complex));
+        memcpy(mod_vis, new_mod_vis, nuv * sizeof(double complex));
+        new_reg_value[REG_MODELPARAM] = reg_value[REG_MODELPARAM];
+        for (w = 0; w < nwavr + 1; ++w)
+          compute_chi2_chan(&chi2_chan[w * NCHI2], mod_vis, w, nwavr);
+        memcpy(new_chi2_chan, chi2_chan, (nwavr + 1) * NCHI2 * sizeof(double));
+        chi2_correction = 2.0 * lLikelihood;
+        lLikelihood = 0.5 * sum_chi2_chan(chi2_chan, nwavr, &chi2v2, &chi2t3amp, &chi2visamp, &chi2t3phi, &chi2visphi);
+        lPosterior = lLikelihood + lPrior;
+        chi2_correction = 2.0 * lLikelihood - chi2_correction;
+
+        nresync++;
+        if (resync_drift > max_vis_drift)
+          max_vis_drift = resync_drift;
+        if (fabs(chi2_correction) > fabs(max_chi2_correction))
+          max_chi2_correction = chi2_correction;
+        if (squeeze_quiet == FALSE)
+          printf("Chain %d -- Resync at iteration %ld: max |dvis| = %le, chi2 correction = %le\n", iChain, i / (nwavr * nelements), resync_drift, chi2_correction);
+      }
+
       if ((i % (nwavr * nelements)) == 0)
       {
+        temperature[iChain] = ctx->temperature; // publish
+        burn_in_times[iChain] = ctx->burn_in_time;
         chain1 = iChaintoStorage[iChain];
         // Save (x,y) element positions and probabilities
         #pragma omp critical(savestate) // not sure if this is really needed
@@ -870,6 +1247,8 @@ int main(int argc, char **argv)
           saved_lLikelihood[chain1 * niter + i / (nwavr * nelements)] = lLikelihood;
           saved_lPrior[chain1 * niter + i / (nwavr * nelements)] = lPrior;
           saved_lPosterior[chain1 * niter + i / (nwavr * nelements)] = lPosterior;
+          if ((minimization_engine == ENGINE_PARALLEL_TEMPERING) && (i / (nwavr * nelements) >= ceil(0.3 * niter)))
+            accumulate_lLikelihood(&lLikelihood_accumulators[chain1], lLikelihood);
 
           for (j = 0; j < nparams; ++j)
             saved_params[chain1 * nparams * niter + i / (nwavr * nelements) * nparams + j] = params[j];
@@ -880,105 +1259,152 @@ int main(int argc, char **argv)
 
         if ((minimization_engine == ENGINE_PARALLEL_TEMPERING) && (i / (nwavr * nelements) > 0)) // note: prevent swapping states before the second iteration
         {
+          //
+          // Inter-chain exchanges -- no barrier, a chain only waits for the partner it offered a swap to (see swap_slot)
+          //
 
-          // Marginal likelihood estimation -- Step 1 = compute likelihood expectation as MCMC averages
-          lLikelihood_expectation[iChain] = 0;
-          lLikelihood_deviation[iChain] = 0;
-          #pragma omp barrier   // synchronize chains needed here to prevent swapping while computing the averages
-          if (i / (nwavr * nelements) > ceil(0.3 * niter)) // note: we need to check for burn-in info here instead
+          if (use_adaptive_ladder == TRUE) // the temperature belongs to the storage, whose place on the ladder may have moved
+            temperature[iChain] = ladder_temperature(swap_slots, nchains, iChaintoStorage[iChain], log_tmax);
+#ifdef SQUEEZE_MPI
+          // Rank boundaries, even and odd ones in turn: the chains holding the temperatures on both sides trade their states
+          if ((mpi_size > 1) && ((i / (nwavr * nelements)) % RANK_SWAP_INTERVAL == 0))
           {
-            for (j = ceil(0.3 * niter); j < i / (nwavr * nelements); ++j)
-            {
-              // we will average the likelihood for the current chain temperature
-              lLikelihood_expectation[iChain] += saved_lLikelihood[iChaintoStorage[iChain] * niter + j];
-            }
-            lLikelihood_expectation[iChain] /= (i / (nwavr * nelements) - ceil(0.3 * niter));
-
-            for (j = ceil(0.3 * niter); j < i / (nwavr * nelements); ++j)
+            const long rank_step = i / (nwavr * nelements) / RANK_SWAP_INTERVAL;
+            int peer = -1;
+            if ((iChaintoStorage[iChain] == nchains - 1) && (mpi_rank < mpi_size - 1) && (((mpi_rank + 1 + rank_step) % 2) == 0))
+              peer = mpi_rank + 1;
+            else if ((iChaintoStorage[iChain] == 0) && (mpi_rank > 0) && (((mpi_rank + rank_step) % 2) == 0))
+              peer = mpi_rank - 1;
+            if (peer >= 0)
             {
-              // we will average the likelihood for the current chain temperature
-              lLikelihood_deviation[iChain] += (saved_lLikelihood[iChaintoStorage[iChain] * niter + j] - lLikelihood_expectation[iChain])
-                                               * (saved_lLikelihood[iChaintoStorage[iChain] * niter + j] - lLikelihood_expectation[iChain]);
+#ifdef _OPENMP
+              if (gate_chains == TRUE)
+                chain_gate_leave(&gate); // do not hold a thread while waiting for the other rank
+#endif
+              const int rank_swapped = rank_swap(peer, i / (nwavr * nelements), TRUE, rng, temperature[iChain], &lLikelihood, &lPrior, &chi2v2, &chi2t3amp,
+                                                 &chi2t3phi, &chi2visamp, &chi2visphi, element_x, element_y, image, im_vis, mod_vis, param_vis, params, chi2_chan,
+                                                 centroid_image_x, centroid_image_y, reg_value, fluxratio_image, &trip_end, &trip_start, nelements, nwavr, axis_len);
+#ifdef _OPENMP
+              if (gate_chains == TRUE)
+                chain_gate_enter(&gate, iChain);
+#endif
+              if ((peer > mpi_rank) && (rank_swapped >= 0) && (i / (nwavr * nelements) >= ceil(0.3 * niter)))
+              {
+                atomic_fetch_add(&swap_slots[nchains - 1].attempts, 1); // the last slot pairs this rank with the next one
+                atomic_fetch_add(&swap_slots[nchains - 1].accepts, rank_swapped);
+              }
+              if (rank_swapped == 1)
+              {
+                lPosterior = lLikelihood + lPrior;
+                memcpy(new_im_vis, im_vis, nuv * sizeof(double complex));
+                memcpy(new_mod_vis, mod_vis, nuv * sizeof(double complex));
+                memcpy(new_param_vis, param_vis, nuv * sizeof(double complex));
+                memcpy(new_params, params, nparams * sizeof(double));
+                memcpy(new_chi2_chan, chi2_chan, (nwavr + 1) * NCHI2 * sizeof(double));
+                memcpy(new_fluxratio_image, fluxratio_image, nuv * sizeof(double));
+                memcpy(new_reg_value, reg_value, nwavr * NREGULS * sizeof(double));
+                for (w = 0; w < nwavr; ++w)
+                {
+                  edge_stats_full(&edge_stat[w], &image[w * axis_len * axis_len], axis_len * axis_len);
+                  for (int c = 0; c < NCDF; ++c)
+                    if (cdf[w * NCDF + c].coef != NULL)
+                      cdf_state_full(&cdf[w * NCDF + c], &image[w * axis_len * axis_len]);
+                  if (atrous[w].wav != NULL)
+                    atrous_state_full(&atrous[w], &image[w * axis_len * axis_len]);
+                }
+              }
             }
-            if (i / (nwavr * nelements) > ceil(0.3 * niter) + 1)
-              lLikelihood_deviation[iChain] /= (i / (nwavr * nelements) - ceil(0.3 * niter) - 1);
-
           }
-
-          #pragma omp barrier   // synchronize chains
-          //    printf("Chain: %d temperature: %lf iter: %ld lLikelihood_avg: %f \n",
-          //    iChain, temperature[iChain], i / (nwavr * nelements), lLikelihood_expectation[iChain]);
-          #pragma omp single
+#endif
+          // An accepted swap takes effect after this iteration was saved in the old storage
+          if (swap_attempt(swap_slots, &pending_swap, i / (nwavr * nelements), iChain, nchains, lPosterior, rng, temperature, iChaintoStorage, iStoragetoChain,
+                           ceil(0.3 * niter)) == TRUE)
           {
-            // Marginal likelihood estimation -- Step 2 = compute log Z
-            compute_logZ(temperature, iStoragetoChain, lLikelihood_expectation, lLikelihood_deviation, nchains, &logZ, &logZ_err);
-            printf("log Z computed by chain: %d logZ: %f +/- %f \n", iChain, logZ, logZ_err);
-
+#ifdef _OPENMP
+            if (gate_chains == TRUE)
+              chain_gate_leave(&gate); // do not hold a thread while waiting for the partner
+#endif
+            swap_wait(swap_slots, &pending_swap, i / (nwavr * nelements), iChain, nchains, lPosterior, rng, temperature, iChaintoStorage, iStoragetoChain,
+                      ceil(0.3 * niter));
+#ifdef _OPENMP
+            if (gate_chains == TRUE)
+              chain_gate_enter(&gate, iChain);
+#endif
+          }
+          atomic_store(&swap_slots[iChaintoStorage[iChain]].passed, i / (nwavr * nelements));
+          // Round trips coldest -> hottest -> coldest
+          if ((iChaintoStorage[iChain] == 0) && (mpi_rank == 0) && (trip_end != 0))
+          {
+            if (trip_end == 1)
+            {
+              round_trips[iChain]++;
+              round_trip_iterations[iChain] += i / (nwavr * nelements) - trip_start;
+            }
+            trip_start = i / (nwavr * nelements);
+            trip_end = 0;
           }
+          else if ((iChaintoStorage[iChain] == nchains - 1) && (mpi_rank == mpi_size - 1) && (trip_end == 0))
+            trip_end = 1;
+          ctx->temperature = temperature[iChain]; // taken over from a swap or the ladder
+        }
 
+        if ((minimization_engine == ENGINE_POPULATION_ANNEALING) && (i / (nwavr * nelements) > 0) && (i / (nwavr * nelements) <= anneal_end))
+        {
           //
-          // Inter-chain exchanges
+          // Population annealing step -- all chains cool together, then the replicas drawn are cloned over those not drawn
           //
-
-          //  printf("Chain %d is ready to switch -- now idle at iteration i= %ld\n", iChain, i);
-          fflush(stdout);
-          iMovedChain[chain1] = 0; // set all chains as ready to switch
+          population[iChain] = (population_replica) { &lLikelihood, &lPrior, &chi2v2, &chi2t3amp, &chi2t3phi, &chi2visamp, &chi2visphi, element_x, element_y,
+                                                      image, params, chi2_chan, centroid_image_x, centroid_image_y, reg_value, fluxratio_image,
+                                                      im_vis, mod_vis, param_vis }; // param_vis moves on accepted parameter steps
+          population_lLikelihood[iChain] = lLikelihood;
+#ifdef _OPENMP
+          if (gate_chains == TRUE)
+            chain_gate_leave(&gate); // every chain has to reach the step
+#endif
           #pragma omp barrier
-          #pragma omp critical(chainswap)
+          #pragma omp single
+          {
+            const double new_temperature = pow(population_tstart, 1. - (double)(i / (nwavr * nelements)) / anneal_end);
+            double ess, log_weight_var;
+            population_logZ += population_resample(population_lLikelihood, nchains, 1. / new_temperature - 1. / temperature[0], population_rng, population_ancestor,
+                                                   &ess, &log_weight_var, &arena);
+            population_logZ_var += log_weight_var;
+            for (j = 0; j < nchains; ++j)
+              temperature[j] = new_temperature;
+            population_stop = ctrlcpressed;
+            if ((squeeze_quiet == FALSE) && (((i / (nwavr * nelements)) % STEPS_PER_OUTPUT == 0) || (i / (nwavr * nelements) == anneal_end)))
+              printf("Population annealing -- Iteration %ld: T = %f, effective population %.1f of %d, logZ so far %f\n", i / (nwavr * nelements), new_temperature,
+                     ess, nchains, population_logZ);
+          }
+          if (population_ancestor[iChain] != iChain)
           {
-            // Inter-chain  Metropolis-Hastings temperature swap
-            // 1) only one chain should try to swap temperature at the same time, hence the omp critical statement above
-            // 2) we only swap adjacent temperatures. There is no warranty that iChain and iChain+1 have adjacent temperatures,
-            //    so we actually do not try to switch these. Instead we keep track of the temperatures.
-            //    iStoragetoChain[N] give us the index of the chain that currently has the Nth temperature (in the sorted list of increasing temperatures)
-            //    so iStoragetoChain[0] gives use the lowest temperature, i.e. T=1 for typical parallel tempering
-            //    and iStoragetoChain[1] would give us the next lowest temperature
-            //    the following code is set so we only try to swap iStoragetoChain[iChain] with iStoragetoChain[iChain+1]
-            // 3) we also track which chains have been swapped through iMovedChain, to prevent sequential swapping (0->1 then 1->2)
-
-            if (iChain < (nchains - 1))
+            clone_replica(&population[population_ancestor[iChain]], &population[iChain], nelements, nwavr, axis_len);
+            lPosterior = lLikelihood + lPrior;
+            memcpy(new_im_vis, im_vis, nuv * sizeof(double complex));
+            memcpy(new_mod_vis, mod_vis, nuv * sizeof(double complex));
+            memcpy(new_param_vis, param_vis, nuv * sizeof(double complex));
+            memcpy(new_params, params, nparams * sizeof(double));
+            memcpy(new_chi2_chan, chi2_chan, (nwavr + 1) * NCHI2 * sizeof(double));
+            memcpy(new_fluxratio_image, fluxratio_image, nuv * sizeof(double));
+            memcpy(new_reg_value, reg_value, nwavr * NREGULS * sizeof(double));
+            for (w = 0; w < nwavr; ++w)
             {
-              chain1 = iStoragetoChain[iChain];
-              chain2 = iStoragetoChain[iChain + 1];
-
-              if ((iMovedChain[chain1] == 0) && (iMovedChain[chain2] == 0))
-              {
-                if (RngStream_RandU01(rng) < 0.3) // base probability of swapping is 30%
-                {
-
-                  transition_test = (1. / temperature[chain1] - 1. / temperature[chain2])
-                                    * (saved_lPosterior[iChaintoStorage[chain1] * niter + i / (nwavr * nelements)]
-                                       - saved_lPosterior[iChaintoStorage[chain2] * niter + i / (nwavr * nelements)]);
-
-                  if (log(RngStream_RandU01(rng)) < transition_test)
-                  {
-                    printf("Swap called from chain %d -- will be swapping chains %d : %f and %d : %f at iteration %ld\n", iChain, chain1,
-                           temperature[chain1], chain2, temperature[chain2], i / (nwavr * nelements));
-
-                    //                   for(j=0;j<nchains;j++)
-                    // printf("BEFORE Chain %ld \t iChaintoStorage %d \t iStoragetoChain %d \t temp[j] %lf \t temp[iStorage[j]] %lf \t temp[iChain[j] %lf\n", j, iChaintoStorage[j], iStoragetoChain[j], temperature[j], temperature[iStoragetoChain[j]],temperature[iChaintoStorage[j]] );
-
-                    //Swap temperatures and other relevant arrays
-                    swapd(&temperature[chain1], &temperature[chain2]);
-                    swapi(&iStoragetoChain[iChaintoStorage[chain1]], &iStoragetoChain[iChaintoStorage[chain2]]);
-                    swapi(&iChaintoStorage[chain1], &iChaintoStorage[chain2]);
-
-                    // printf("Swap done at chain %d -- has swapped chains %d : %f and %d : %f at iteration %ld\n",
-                    //         iChain, chain2, temperature[chain2], chain1,  temperature[chain1], i / (nwavr * nelements));
-
-                    // for(j=0;j<nchains;j++)
-                    //  printf("AFTER Chain %ld \t iChaintoStorage %d \t iStoragetoChain %d \t temp[j] %lf \t temp[iStorage[j]] %lf \t temp[iChain[j] %lf\n", j, iChaintoStorage[j], iStoragetoChain[j], temperature[j], temperature[iStoragetoChain[j]],temperature[iChaintoStorage[j]] );
-
-                    iMovedChain[chain1] = 1;
-                    iMovedChain[chain2] = 1;
-                  }
-                }
-              }
+              edge_stats_full(&edge_stat[w], &image[w * axis_len * axis_len], axis_len * axis_len);
+              for (int c = 0; c < NCDF; ++c)
+                if (cdf[w * NCDF + c].coef != NULL)
+                  cdf_state_full(&cdf[w * NCDF + c], &image[w * axis_len * axis_len]);
+              if (atrous[w].wav != NULL)
+                atrous_state_full(&atrous[w], &image[w * axis_len * axis_len]);
             }
           }
-          #pragma omp barrier   //re-synchronise Chains before continuing
-          //fflush(stdout);
-          //printf("%d Chain %d movement reset to 0 iter %ld\n", iChain, chain1, i / (nwavr * nelements) );
+          #pragma omp barrier // the replicas drawn stay untouched until all their clones are made
+          ctx->temperature = temperature[iChain];
+#ifdef _OPENMP
+          if (gate_chains == TRUE)
+            chain_gate_enter(&gate, iChain);
+#endif
+          if (population_stop == TRUE)
+            break;
         }
 
       }
@@ -996,6 +1422,13 @@ int main(int argc, char **argv)
         if (squeeze_quiet == FALSE) print_diagnostics(iChain, (i / (nwavr * nelements) + 1), nvis, nv2, nt3, nt3phi, nt3amp, nvisamp, nvisphi, chi2v2, chi2t3amp, chi2t3phi,
                           chi2visphi, chi2visamp, lPosterior, lPrior, lLikelihood, reg_param, reg_value, centroid_image_x, centroid_image_y, nelements, nwavr,
                           niter, temperature, prob_movement, params, stepsize, burn_in_times);
+        // Running logZ, cheap now that the likelihood moments are accumulated on the fly
+        if ((minimization_engine == ENGINE_PARALLEL_TEMPERING) && (iChain == 0) && (nchains > 1) && (mpi_size == 1) && (squeeze_quiet == FALSE)
+            && (i / (nwavr * nelements) > ceil(0.3 * niter)))
+        {
+          storage_logZ(lLikelihood_accumulators, temperature, iStoragetoChain, nchains, lLikelihood_expectation, lLikelihood_deviation, &logZ, &logZ_err);
+          printf("log Z computed by chain: %d logZ: %f +/- %f \n", iChain, logZ, logZ_err);
+        }
 //getchar();
         if (prob_auto > 0)
           tmin = tmin * (1.0 - .5 * (prob_movement - prob_auto)); // BUG ? should this be here ?
@@ -1026,54 +1459,7 @@ int main(int argc, char **argv)
       if ((nparams == 0) || (current_elt < nelements)) /* Attempt image movement rather than parametric model movement */
       {
 
-        zerostep = TRUE;
-        // select step
-        while(zerostep == TRUE)
-        {
-          switch (steptype)
-          {
-            case STEP_SMALL: /* One step in either x or y direction */
-          xstep = rlong % 4;
-          rlong /= 4;
-          if (xstep > 1)      // 2 or 3, we select a y move
-          {
-            ystep = (xstep - 2) * 2 - 1;
-            xstep = 0;
-          }
-          else       // 0 or 1, we select a x movement
-          {
-            ystep = 0;
-            xstep = xstep * 2 - 1;
-          }
-          break;
-        case STEP_MEDIUM: /* Up to 2 steps in x and y direction */
-          xstep = (rlong % 5) - 2;
-          rlong /= 5;
-          ystep = (rlong % 5) - 2;
-          rlong /= 5;
-          break;
-        case STEP_ANYWHERE: /* Move flux anywhere in image */
-          //xstep = (rlong % axis_len) - axis_len / 2;
-          // rlong = RngStream_RandInt(rng, 0, 2147483647);
-          // ystep = (rlong % axis_len) - axis_len / 2;
-          // rlong /= axis_len;
-          xstep = (RngStream_RandInt(rng, 0, 2147483647) % axis_len) - axis_len / 2;
-          // rlong = RngStream_RandInt(rng, 0, 2147483647);
-          ystep = (RngStream_RandInt(rng, 0, 2147483647) % axis_len) - axis_len / 2;
-          // rlong /= axis_len;
-          break;
-
-        case STEP_COPYCAT: /* Copy the position of another element */
-          xstep = element_x[chan * nelements + rlong % nelements] - element_x[chan * nelements + current_elt];
-          ystep = element_y[chan * nelements + rlong % nelements] - element_y[chan * nelements + current_elt];
-          rlong = RngStream_RandInt(rng, 0, 2147483647);
-          break;
-        }
-        if( (xstep !=0) || (ystep != 0) )
-          zerostep = FALSE;
-          else // old position == new position --> we want to redraw
-          rlong = RngStream_RandInt(rng, 0, 2147483647);
-      }
+        draw_element_step(rng, &rlong, steptype, element_x, element_y, chan, current_elt, nelements, axis_len, &xstep, &ystep);
 
         old_x = element_x[chan * nelements + current_elt];
         old_y = element_y[chan * nelements + current_elt];
@@ -1084,99 +1470,111 @@ int main(int argc, char **argv)
         new_pos = chan * axis_len * axis_len + new_y * axis_len + new_x;
 
         //
-        // Regularization update
+        // Multiple-try Metropolis: draw mtm_tries candidates, select one according to its posterior weight,
+        // then weigh it against mtm_tries - 1 reference points drawn from it plus the current position
         //
-
-	// Regularizations for which we know the finite difference
-        if (reg_param[REG_ENTROPY] > 0.0)
-          new_reg_value[chan * NREGULS + REG_ENTROPY] = reg_value[chan * NREGULS + REG_ENTROPY]
-	    - entropy(image[old_pos]) + entropy(image[old_pos] - 1)+ entropy(image[new_pos] + 1) - entropy(image[new_pos]);
-        if (reg_param[REG_PRIORIMAGE] > 0.0)
-          new_reg_value[chan * NREGULS + REG_PRIORIMAGE] = reg_value[chan * NREGULS + REG_PRIORIMAGE]
-	    - prior_image[old_pos] + prior_image[new_pos];
-        if (reg_param[REG_DARKENERGY] > 0.0)
-          new_reg_value[chan * NREGULS + REG_DARKENERGY] = reg_value[chan * NREGULS + REG_DARKENERGY]
-	    - den_change(image, old_x, old_y, DEN_SUBTRACT, axis_len) + den_change(image, new_x, new_y, DEN_ADD, axis_len);
-
-    if (reg_param[REG_L0] > 0.0)
-    {
-       new_reg_value[chan * NREGULS + REG_L0] = reg_value[chan * NREGULS + REG_L0] + (double)((image[new_pos]<.5)?1.0:0.0)
-       - (double)(( (image[old_pos]>0.5)&&(image[old_pos]<1.5))?1.0:0.0);
-    }
-
-     if (reg_param[REG_TRANSPECL2] > 0.0)
-        new_reg_value[REG_TRANSPECL2] = reg_value[REG_TRANSPECL2]//transpec(nwavr, axis_len, image, (const double) nelements)
-                 - transpec_diffpoint(old_y * axis_len + old_x, chan, 0.0, nwavr, axis_len*axis_len, image) - transpec_diffpoint(new_y * axis_len + new_x, chan, 0.0, nwavr, axis_len*axis_len, image)    // remove old contribution
-                     + transpec_diffpoint(old_y * axis_len + old_x, chan , -1.0, nwavr, axis_len*axis_len, image) + transpec_diffpoint(new_y * axis_len + new_x, chan , 1.0, nwavr, axis_len*axis_len, image);
-
-
-
-
-     // Regularization for which we need to recompute the whole thing
-        image[old_pos]--;
-        image[new_pos]++;
-
-        if (reg_param[REG_SPOT] > 0.0)
-          new_reg_value[chan * NREGULS + REG_SPOT] = UDreg(&image[chan * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, (const double) nelements);
-        if (reg_param[REG_TV] > 0.0)
-          new_reg_value[chan * NREGULS + REG_TV] = TV(&image[chan * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, (const double) nelements);
-
-        if (reg_param[REG_LAP] > 0.0)
-          new_reg_value[chan * NREGULS + REG_LAP] = LAP(&image[chan * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, (const double) nelements);
-
-        if (reg_param[REG_L0CDF53] > 0.0)
-          new_reg_value[chan * NREGULS + REG_L0CDF53] = L0_CDF53(&image[chan * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, (const double) nelements);
-
-        if (reg_param[REG_L1CDF53] > 0.0)
-          new_reg_value[chan * NREGULS + REG_L1CDF53] = L1_CDF53(&image[chan * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, (const double) nelements);
-
-        if (reg_param[REG_L0CDF97] > 0.0)
-          new_reg_value[chan * NREGULS + REG_L0CDF97] = L0_CDF97(&image[chan * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, (const double) nelements);
-
-        if (reg_param[REG_L1CDF97] > 0.0)
-          new_reg_value[chan * NREGULS + REG_L1CDF97] = L1_CDF97(&image[chan * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, (const double) nelements);
-
-        if (reg_param[REG_L0ATROUS] > 0.0)
-          new_reg_value[chan * NREGULS + REG_L0ATROUS] = L0_ATROUS(&image[chan * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, (const double) nelements);
-
-        if (reg_param[REG_L1ATROUS] > 0.0)
-          new_reg_value[chan * NREGULS + REG_L1ATROUS] = L1_ATROUS(&image[chan * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, (const double) nelements);
-
-        if (reg_param[REG_EDGE] > 0.0)
-          new_reg_value[chan * NREGULS + REG_EDGE] = EDGE(&image[chan * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, (const double) nelements);
-
-
-        //printf("%lf ", fabs(new_reg_value[REG_TRANSPECL2]-transpec(nwavr, axis_len, image, (const double) nelements)));
-        //       if (reg_param[REG_TRANSPECL2] > 0.0)
-        //  new_reg_value[REG_TRANSPECL2] = transpec(nwavr, axis_len, image, (const double) nelements);
-
-        // Go back to current state
-        image[old_pos]++;
-        image[new_pos]--;
-
-        if (reg_param[REG_CENTERING] > 0.0)
+        mtm_step = (mtm_tries > 1);
+        if (mtm_step == TRUE)
         {
-          //if((reg_param[REG_TRANSPECL2] > 0.0) && chan > 0
-          new_reg_value[chan * NREGULS + REG_CENTERING] = reg_value[chan * NREGULS + REG_CENTERING]
-              + fov * cent_change(chan, centroid_image_x, centroid_image_y, new_x, new_y, old_x, old_y, axis_len, fov, cent_mult);
-        }
+          compute_lPrior_allwav(&lPrior, nwavr, reg_param, reg_value);
+          chi2_others = 2.0 * lLikelihood - (chi2_chan[chan * NCHI2 + CHI2_V2] + chi2_chan[chan * NCHI2 + CHI2_T3AMP] + chi2_chan[chan * NCHI2 + CHI2_VISAMP]
+                                             + chi2_chan[chan * NCHI2 + CHI2_T3PHI] + chi2_chan[chan * NCHI2 + CHI2_VISPHI]);
+          mtm_x[0] = new_x;
+          mtm_y[0] = new_y;
+          for (k = 1; k < mtm_tries; ++k)
+          {
+            rlong = RngStream_RandInt(rng, 0, 2147483647);
+            draw_element_step(rng, &rlong, steptype, element_x, element_y, chan, current_elt, nelements, axis_len, &xstep, &ystep);
+            mtm_x[k] = (old_x + xstep + axis_len) % axis_len;
+            mtm_y[k] = (old_y + ystep + axis_len) % axis_len;
+          }
+          mtm_log_weights(mtm_lw, mtm_x, mtm_y, mtm_tries, mtm_vis, mtm_reg_value, im_vis, param_vis, fluxratio_image, chain_xtransform, chain_ytransform, reg_param, reg_value,
+                          image, prior_image, edge_stat, cdf, atrous, centroid_image_x, centroid_image_y, chan, old_x, old_y, axis_len, nwavr, nelements, fov, cent_mult,
+                          chi2_others, lLikelihood, lPrior, ctx->temperature);
+
+          mtm_max_lw = mtm_lw[0];
+          for (k = 1; k < mtm_tries; ++k)
+            if (mtm_lw[k] > mtm_max_lw)
+              mtm_max_lw = mtm_lw[k];
+          mtm_sum = 0; // selection only, the acceptance sums are rescaled below
+          for (k = 0; k < mtm_tries; ++k)
+            mtm_sum += exp(mtm_lw[k] - mtm_max_lw);
+          mtm_u = RngStream_RandU01(rng) * mtm_sum;
+          for (mtm_select = 0; mtm_select < mtm_tries - 1; ++mtm_select)
+          {
+            mtm_u -= exp(mtm_lw[mtm_select] - mtm_max_lw);
+            if (mtm_u < 0)
+              break;
+          }
+          new_x = mtm_x[mtm_select];
+          new_y = mtm_y[mtm_select];
+          new_pos = chan * axis_len * axis_len + new_y * axis_len + new_x;
 
-        if (reg_param[REG_MODELPARAM] > 0.0)
-          new_reg_value[REG_MODELPARAM] = reg_value[REG_MODELPARAM];
+          // reference points are drawn from the selected candidate, the last one is the current position
+          element_x[chan * nelements + current_elt] = new_x;
+          element_y[chan * nelements + current_elt] = new_y;
+          for (k = 0; k < mtm_tries - 1; ++k)
+          {
+            rlong = RngStream_RandInt(rng, 0, 2147483647);
+            draw_element_step(rng, &rlong, steptype, element_x, element_y, chan, current_elt, nelements, axis_len, &xstep, &ystep);
+            mtm_ref_x[k] = (new_x + xstep + axis_len) % axis_len;
+            mtm_ref_y[k] = (new_y + ystep + axis_len) % axis_len;
+          }
+          element_x[chan * nelements + current_elt] = old_x;
+          element_y[chan * nelements + current_elt] = old_y;
+          mtm_log_weights(mtm_ref_lw, mtm_ref_x, mtm_ref_y, mtm_tries - 1, mtm_vis, mtm_reg_value, im_vis, param_vis, fluxratio_image, chain_xtransform, chain_ytransform, reg_param,
+                          reg_value, image, prior_image, edge_stat, cdf, atrous, centroid_image_x, centroid_image_y, chan, old_x, old_y, axis_len, nwavr, nelements, fov, cent_mult,
+                          chi2_others, lLikelihood, lPrior, ctx->temperature);
+          // both sums share the same offset, the current position (log weight 0) is one of the reference points
+          for (k = 0; k < mtm_tries - 1; ++k)
+            if (mtm_ref_lw[k] > mtm_max_lw)
+              mtm_max_lw = mtm_ref_lw[k];
+          if (mtm_max_lw < 0)
+            mtm_max_lw = 0;
+          mtm_sum = 0;
+          for (k = 0; k < mtm_tries; ++k)
+            mtm_sum += exp(mtm_lw[k] - mtm_max_lw);
+          mtm_ref_sum = exp(-mtm_max_lw);
+          for (k = 0; k < mtm_tries - 1; ++k)
+            mtm_ref_sum += exp(mtm_ref_lw[k] - mtm_max_lw);
+
+          mtm_accept = (RngStream_RandU01(rng) * mtm_ref_sum < mtm_sum);
+        }
 
-        /* Modify the visibilities */
-        //#pragma omp parallel for simd
-       for (j = 0; j < nuv; ++j)
+        uv_start = chan_uv_start[chan];
+        uv_end = chan_uv_start[chan + 1];
+        if ((mtm_step == TRUE) && (mtm_accept == FALSE))
+          uv_end = uv_start; // nothing to evaluate, the move is rejected
+        else
         {
-          if (uvwav2chan[j] == chan)
+          //
+          // Regularization update
+          //
+          element_move_regularizers(reg_param, reg_value, new_reg_value, image, prior_image, edge_stat, cdf, atrous, centroid_image_x, centroid_image_y, chan, old_x, old_y, new_x, new_y,
+                                    axis_len, nwavr, nelements, fov, cent_mult);
+
+          /* Modify the visibilities -- only the uv points of channel chan are affected, split across the chain's team if large enough */
+          #pragma omp parallel num_threads(chain_threads) if ((chain_threads > 1) && (uv_end - uv_start >= par_threshold))
           {
-            new_im_vis[j] = im_vis[j]
-                            + (xtransform[new_x * nuv + j] * ytransform[new_y * nuv + j] - xtransform[old_x * nuv + j] * ytransform[old_y * nuv + j])
-                            * fluxratio_image[j] / (double) nelements;
+            long sub_start, sub_end;
+            team_uv_range(uv_start, uv_end, &sub_start, &sub_end);
+            if (use_float_phasors == TRUE)
+              update_vis_element_move_float(new_im_vis, new_mod_vis, im_vis, param_vis, fluxratio_image, chain_xtransform_f, chain_ytransform_f,
+                                            new_x, new_y, old_x, old_y, sub_start, sub_end, (double) nelements);
+            else if (chain_xtransform == NULL)
+            {
+              // generate the four columns, stored as rows 0 (new) and 1 (old) of the scratch tables
+              phasor_row(&move_xrows[0], xphasor_base, new_x - axis_len / 2, sub_start, sub_end);
+              phasor_row(&move_xrows[2 * nuv], xphasor_base, old_x - axis_len / 2, sub_start, sub_end);
+              phasor_row(&move_yrows[0], yphasor_base, new_y - axis_len / 2, sub_start, sub_end);
+              phasor_row(&move_yrows[2 * nuv], yphasor_base, old_y - axis_len / 2, sub_start, sub_end);
+              update_vis_element_move(new_im_vis, new_mod_vis, im_vis, param_vis, fluxratio_image, move_xrows, move_yrows,
+                                      0, 0, 1, 1, sub_start, sub_end, (double) nelements);
+            }
+            else
+              update_vis_element_move(new_im_vis, new_mod_vis, im_vis, param_vis, fluxratio_image, chain_xtransform, chain_ytransform,
+                                      new_x, new_y, old_x, old_y, sub_start, sub_end, (double) nelements);
           }
-          else
-            new_im_vis[j] = im_vis[j];
-          new_mod_vis[j] = new_im_vis[j] + param_vis[j];
         }
 
         prob_movement *= (1.0 - 1.0 / DAMPING_TIME);
@@ -1184,6 +1582,7 @@ int main(int argc, char **argv)
       }
       else   /* Attempt parametric model movement -- model visibilities are recomputed from scratch */
       {
+        mtm_step = FALSE;
 
         xstep = rlong % 2; /* The type of step to be taken */
         rlong /= 2;
@@ -1195,6 +1594,8 @@ int main(int argc, char **argv)
         model_vis(new_params, new_param_vis, &new_reg_value[REG_MODELPARAM], new_fluxratio_image);
         prob_pmovement[j] *= 1.0 - 1.0 / PARAM_DAMPING_TIME;
         stepsize[j] *= 1.0 + (prob_pmovement[j] - TARGET_MPROB) / STEPSIZE_ADJUST_TIME;
+        uv_start = 0;
+        uv_end = nuv;
         for (j = 0; j < nuv; ++j)
         {
           new_im_vis[j] = im_vis[j] * new_fluxratio_image[j] / fluxratio_image[j];
@@ -1206,13 +1607,48 @@ int main(int argc, char **argv)
       // Evaluate posterior probability
       //
 
-      compute_lLikelihood(&new_lLikelihood, new_mod_vis, res, mod_obs, &chi2v2, &chi2t3amp, &chi2visamp, &chi2t3phi, &chi2visphi, nwavr);
       compute_lPrior_allwav(&lPrior, nwavr, reg_param, reg_value);
       compute_lPrior_allwav(&new_lPrior, nwavr, reg_param, new_reg_value);
-      new_lPosterior = new_lLikelihood + new_lPrior ;
 
-      // BUG: think how to rescale priors with fluxratio_image ?
-      transition_test = (new_lLikelihood - lLikelihood) / temperature[iChain] + new_lPrior - lPrior;
+      // The uniform variate of the Metropolis test is already known, so is the largest chi2 that can be accepted
+      if (use_early_rejection == TRUE)
+      {
+        chi2_bound = 2.0 * (lLikelihood + ctx->temperature * (-log(((double)(rlong % 1024) + 0.5) / 1024.0) - new_lPrior + lPrior));
+        chi2_bound += EARLY_REJECT_SLACK * fabs(chi2_bound);
+      }
+      else
+        chi2_bound = HUGE_VAL;
+
+      if (mtm_step == TRUE) // the multiple-try decision is already taken
+        chi2_bound = (mtm_accept == TRUE) ? HUGE_VAL : -HUGE_VAL;
+
+      if ((use_chan_likelihood == TRUE) && (current_elt < nelements)) // element move: only channel chan has changed
+      {
+        chi2_others = 2.0 * lLikelihood - (chi2_chan[chan * NCHI2 + CHI2_V2] + chi2_chan[chan * NCHI2 + CHI2_T3AMP] + chi2_chan[chan * NCHI2 + CHI2_VISAMP]
+                                           + chi2_chan[chan * NCHI2 + CHI2_T3PHI] + chi2_chan[chan * NCHI2 + CHI2_VISPHI]);
+        chi2_partial = chi2_others + compute_chi2_chan_bounded(&new_chi2_chan[chan * NCHI2], new_mod_vis, chan, nwavr, chi2_bound - chi2_others);
+      }
+      else
+      {
+        chi2_partial = 0;
+        for (w = 0; (w < nwavr + 1) && (chi2_partial <= chi2_bound); ++w)
+          chi2_partial += compute_chi2_chan_bounded(&new_chi2_chan[w * NCHI2], new_mod_vis, w, nwavr, chi2_bound - chi2_partial);
+      }
+
+      if (chi2_partial > chi2_bound) // rejected before the full chi2 was known
+      {
+        new_lLikelihood = 0.5 * chi2_partial;
+        transition_test = HUGE_VAL;
+      }
+      else
+      {
+        new_lLikelihood = 0.5 * sum_chi2_chan(new_chi2_chan, nwavr, &chi2v2, &chi2t3amp, &chi2visamp, &chi2t3phi, &chi2visphi);
+        // BUG: think how to rescale priors with fluxratio_image ?
+        transition_test = (new_lLikelihood - lLikelihood) / ctx->temperature + new_lPrior - lPrior;
+        if (mtm_step == TRUE)
+          transition_test = -HUGE_VAL;
+      }
+      new_lPosterior = new_lLikelihood + new_lPrior ;
 
       if ((double)(rlong % 1024) + 0.5 < 1024.0 * exp(-transition_test))
       {
@@ -1221,24 +1657,33 @@ int main(int argc, char **argv)
         lLikelihood = new_lLikelihood;
         lPosterior = new_lPosterior;
         lPrior = new_lPrior;
+        memcpy(chi2_chan, new_chi2_chan, (nwavr + 1) * NCHI2 * sizeof(double));
 
-        /* Swap mod_vis and new_mod_vis*/
-        dummy_cpointer = mod_vis;
-        mod_vis = new_mod_vis;
-        new_mod_vis = dummy_cpointer;
-
-        /* Swap im_vis and new_im_vis */
-        dummy_cpointer = im_vis;
-        im_vis = new_im_vis;
-        new_im_vis = dummy_cpointer;
+        /* Copy the modified uv range of new_mod_vis and new_im_vis */
+        memcpy(&mod_vis[uv_start], &new_mod_vis[uv_start], (uv_end - uv_start) * sizeof(double complex));
+        memcpy(&im_vis[uv_start], &new_im_vis[uv_start], (uv_end - uv_start) * sizeof(double complex));
 
         /* For flux movement, update the image and regularizers */
         if (current_elt < nelements)
         {
+          if (reg_param[REG_EDGE] > 0.0)
+            edge_stats_move(&edge_stat[chan], &image[chan * axis_len * axis_len], old_pos - chan * axis_len * axis_len, new_pos - chan * axis_len * axis_len,
+                            axis_len * axis_len);
           image[old_pos]--;
           element_x[chan * nelements + current_elt] = new_x;
           element_y[chan * nelements + current_elt] = new_y;
           image[new_pos]++;
+          for (int c = 0; c < NCDF; ++c)
+            if (cdf[chan * NCDF + c].coef != NULL)
+            {
+              double dL0, dL1;
+              cdf_state_move(&cdf[chan * NCDF + c], &image[chan * axis_len * axis_len], old_x, old_y, new_x, new_y, &dL0, &dL1);
+            }
+          if (atrous[chan].wav != NULL)
+          {
+            double dL0, dL1;
+            atrous_state_move(&atrous[chan], &image[chan * axis_len * axis_len], old_x, old_y, new_x, new_y, &dL0, &dL1);
+          }
           for(int r = 1; r < NREGULS-1; ++r) // update all spatial regularizers /bug should we include MODELPARAM ?
 	         reg_value[chan * NREGULS + r] = new_reg_value[chan * NREGULS + r];
 
@@ -1267,31 +1712,34 @@ int main(int argc, char **argv)
         if (minimization_engine == ENGINE_SIMULATED_ANNEALING)
         {
           /* If chi^2 has changed, change the temperature... */
-          temperature[iChain] *= 1.0
-                                 + 1.0 / temperature[iChain] / TEMP_CHANGE_TIME * (2. * lLikelihood / ndf - chi2_temp * temperature[iChain])
-                                 * (2. * lLikelihood / ndf - chi2_target) * ndf / (2. * lLikelihood);
-
-          if ((temperature[iChain] < tmin) || (2. * lLikelihood / ndf < chi2_target)) // convergence
-            if ((i / (nwavr * nelements) + niter / BURN_IN_FRAC) < burn_in_times[iChain])
-              burn_in_times[iChain] = i / (nwavr * nelements) + niter / BURN_IN_FRAC;
-
-          if (temperature[iChain] < tmin)
-            temperature[iChain] = tmin;
-          if (temperature[iChain] > FLAT_CHI2_MULT * flat_chi2 / ndf)
-            temperature[iChain] = FLAT_CHI2_MULT * flat_chi2 / ndf;
+          ctx->temperature *= 1.0
+                              + 1.0 / ctx->temperature / TEMP_CHANGE_TIME * (2. * lLikelihood / ndf - chi2_temp * ctx->temperature)
+                              * (2. * lLikelihood / ndf - chi2_target) * ndf / (2. * lLikelihood);
+
+          if ((ctx->temperature < tmin) || (2. * lLikelihood / ndf < chi2_target)) // convergence
+            if ((i / (nwavr * nelements) + niter / BURN_IN_FRAC) < ctx->burn_in_time)
+              ctx->burn_in_time = i / (nwavr * nelements) + niter / BURN_IN_FRAC;
+
+          if (ctx->temperature < tmin)
+            ctx->temperature = tmin;
+          if (ctx->temperature > FLAT_CHI2_MULT * flat_chi2 / ndf)
+            ctx->temperature = FLAT_CHI2_MULT * flat_chi2 / ndf;
         }
 
       }
       else
       {
         // The proposed new state was rejected
+        memcpy(new_chi2_chan, chi2_chan, (nwavr + 1) * NCHI2 * sizeof(double));
+        memcpy(&new_mod_vis[uv_start], &mod_vis[uv_start], (uv_end - uv_start) * sizeof(double complex));
+        memcpy(&new_im_vis[uv_start], &im_vis[uv_start], (uv_end - uv_start) * sizeof(double complex));
         if (current_elt < nelements) // flux movement was attempted and rejected
         {
           //if((xstep == 0) && (ystep == 0))
           //     printf("Rejected movement of 0 steps, delta_chi2 = %lf: \n", 2.*(new_lLikelihood - lLikelihood) );
 
           /* Reverse the centering change */
-          if (reg_param[REG_CENTERING] > 0)
+          if ((reg_param[REG_CENTERING] > 0) && (mtm_step == FALSE))
             cent_change(chan, centroid_image_x, centroid_image_y, old_x, old_y, new_x, new_y, axis_len, fov, cent_mult);
         }
         else       // parameter movement was attempted and rejected
@@ -1344,11 +1792,19 @@ int main(int argc, char **argv)
 
       /* If we're on the smallest step size, we may want to change to steptype COPYCAT */
 
-      if (ctrlcpressed == TRUE)
+      if ((ctrlcpressed == TRUE) && ((minimization_engine != ENGINE_POPULATION_ANNEALING) || (i / (nwavr * nelements) >= anneal_end))) // population annealing stops at a step
         break;
     } // end iterations
+    atomic_store(&swap_slots[iChaintoStorage[iChain]].passed, LONG_MAX); // no more answers from this chain
+    temperature[iChain] = ctx->temperature;
+    burn_in_times[iChain] = ctx->burn_in_time;
 
     //printf("End of chain %i\n", iChain);
+    if (vis_resync > 0)
+      printf("Chain %d -- Visibility resync: max |dvis| = %le, largest chi2 correction = %le over %ld resyncs\n", iChain, max_vis_drift, max_chi2_correction, nresync);
+    if (squeeze_quiet == FALSE)
+      printf("Chain %d -- Scratch arena: %zu of %zu bytes at peak, %ld heap fallbacks in the main loop\n", iChain, arena.peak, arena.size,
+             arena.nheap - arena_nheap);
 
     /* Write the fits file */
     if (ctrlcpressed == FALSE)
@@ -1377,22 +1833,103 @@ int main(int argc, char **argv)
     free(new_params);
     free(stepsize);
     free(prob_pmovement);
-    free(res);
-    free(mod_obs);
+    free(chi2_chan);
+    free(new_chi2_chan);
+    free(move_xrows);
+    free(move_yrows);
+    free(mtm_vis);
+    free(mtm_reg_value);
     free(image);
 
     free(fluxratio_image);
     free(new_fluxratio_image);
+    free(edge_stat);
+    for (int c = 0; c < nwavr * NCDF; ++c)
+      if (cdf[c].coef != NULL)
+        cdf_state_free(&cdf[c], &arena);
+    free(cdf);
+    for (w = 0; w < nwavr; ++w)
+      if (atrous[w].wav != NULL)
+        atrous_state_free(&atrous[w], &arena);
+    free(atrous);
+    free(arena.base);
 
+#ifdef _OPENMP
+    if (gate_chains == TRUE)
+      chain_gate_leave(&gate);
+#endif
     #pragma omp barrier    // Synchronize chains
   }
+#ifdef _OPENMP
+  if (gate_chains == TRUE)
+    chain_gate_free(&gate);
+  sampling_time = omp_get_wtime() - sampling_time;
+#else
+  sampling_time = (double) clock() / CLOCKS_PER_SEC - sampling_time;
+#endif
 
   //
   // End of parallel chains
   //
 
+#ifdef SQUEEZE_MPI
+  // Rank 0 reports for the whole ladder. It only gathers what the output needs: temperatures, likelihood moments, swap and
+  // round trip counts per storage, and the saved chains of the other ranks for -steppingstone or -fullchain only
+  if (mpi_size > 1)
+  {
+    double *storage_temperature = malloc(nchains * sizeof(double));
+    for (i = 0; i < nchains; ++i)
+      storage_temperature[i] = temperature[iStoragetoChain[i]];
+    long *swap_counts = malloc(2 * nchains * sizeof(long));
+    for (i = 0; i < nchains; ++i)
+    {
+      swap_counts[2 * i] = atomic_load(&swap_slots[i].attempts); // slot nchains - 1: boundary with the next rank
+      swap_counts[2 * i + 1] = atomic_load(&swap_slots[i].accepts);
+    }
+    free(temperature);
+    temperature = rank_gather(storage_temperature, nchains * sizeof(double));
+    swap_counts = rank_gather(swap_counts, 2 * nchains * sizeof(long));
+    round_trips = rank_gather(round_trips, nchains * sizeof(long));
+    round_trip_iterations = rank_gather(round_trip_iterations, nchains * sizeof(long));
+    lLikelihood_accumulators = rank_gather(lLikelihood_accumulators, nchains * sizeof(lLikelihood_accumulator));
+    if ((use_stepping_stone == TRUE) || (dumpchain == TRUE))
+    {
+      saved_lLikelihood = rank_gather(saved_lLikelihood, nchains * niter * sizeof(double));
+      saved_lPrior = rank_gather(saved_lPrior, nchains * niter * sizeof(double));
+      saved_lPosterior = rank_gather(saved_lPosterior, nchains * niter * sizeof(double));
+    }
+    if (dumpchain == TRUE)
+    {
+      saved_x = rank_gather(saved_x, nchains * niter * nwavr * nelements * sizeof(unsigned short));
+      saved_y = rank_gather(saved_y, nchains * niter * nwavr * nelements * sizeof(unsigned short));
+      saved_params = rank_gather(saved_params, nchains * niter * nparams * sizeof(double));
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &sampling_time, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &nthreads, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    if (mpi_rank == 0)
+    {
+      // one ladder of nchains * mpi_size temperatures, in storage order
+      nchains *= mpi_size;
+      iChaintoStorage = realloc(iChaintoStorage, nchains * sizeof(unsigned short));
+      iStoragetoChain = realloc(iStoragetoChain, nchains * sizeof(unsigned short));
+      lLikelihood_expectation = realloc(lLikelihood_expectation, nchains * sizeof(double));
+      lLikelihood_deviation = realloc(lLikelihood_deviation, nchains * sizeof(double));
+      free(swap_slots);
+      swap_slots = cache_aligned_calloc(nchains, sizeof(swap_slot));
+      for (i = 0; i < nchains; ++i)
+      {
+        iChaintoStorage[i] = i;
+        iStoragetoChain[i] = i;
+        atomic_store(&swap_slots[i].attempts, swap_counts[2 * i]);
+        atomic_store(&swap_slots[i].accepts, swap_counts[2 * i + 1]);
+      }
+    }
+    free(swap_counts);
+  }
+#endif
+
   //
-  if (ctrlcpressed == FALSE)
+  if ((ctrlcpressed == FALSE) && (mpi_rank == 0))
   {
 
     // Determine the number of usable frames for statistics and image averaging
@@ -1462,17 +1999,47 @@ int main(int argc, char **argv)
         if(burn_in_times[i] < (niter - depth)) burn_in_times[i] = niter - depth ; // note: we previously ensured depth <= niter so this is safe
         }
 
+      double logZ = 0, logZe = 0.;
+      if (minimization_engine == ENGINE_POPULATION_ANNEALING)
+      {
+        logZ = population_logZ;
+        logZe = sqrt(population_logZ_var);
+        printf("Output -- Population annealing log(Z(1) / Z(1/%f)): %f +/- %f\n", population_tstart, logZ, logZe);
+      }
       mcmc_results(minimization_engine, output_filename, nchains, burn_in_times, depth, nelements, axis_len, xtransform, ytransform, saved_x, saved_y,
                              saved_params, niter, nwavr, final_params, final_params_std, reg_param, final_reg_value, prior_image, initial_x, initial_y, centroid_image_x,
-		   centroid_image_y, fov, cent_mult, ndf, tmin, chi2_temp, chi2_target, mas_pixel, init_filename, prior_filename, 0, 0);
+		   centroid_image_y, fov, cent_mult, ndf, tmin, chi2_temp, chi2_target, mas_pixel, init_filename, prior_filename, logZ, logZe);
 
 
     }
     else // (minimization_engine == ENGINE_PARALLEL_TEMPERING)
     {
       double logZ = 0, logZe = 0.;
-      compute_logZ(temperature, iStoragetoChain, lLikelihood_expectation, lLikelihood_deviation, nchains, &logZ, &logZe);
+      for (i = 0; i < nchains; ++i)
+      {
+        total_round_trips += round_trips[i];
+        mean_round_trip += round_trip_iterations[i];
+      }
+      if (total_round_trips > 0)
+        mean_round_trip /= total_round_trips;
+      printf("Output -- Round trips between the coldest and hottest temperature: %ld, mean duration %f iterations, %f per CPU-hour\n", total_round_trips,
+             mean_round_trip, total_round_trips / (nthreads * sampling_time / 3600.));
+      nswap_pairs = nchains - 1;
+      swap_rates = malloc(nswap_pairs * sizeof(double));
+      for (i = 0; i < nswap_pairs; ++i)
+      {
+        swap_rates[i] = (atomic_load(&swap_slots[i].attempts) > 0) ? (double) atomic_load(&swap_slots[i].accepts) / atomic_load(&swap_slots[i].attempts) : 0;
+        printf("Output -- Swap rate between T = %f and T = %f: %f (%ld offers answered after burn-in)\n", temperature[iStoragetoChain[i]],
+               temperature[iStoragetoChain[i + 1]], swap_rates[i], atomic_load(&swap_slots[i].attempts));
+      }
+      // Marginal likelihood estimation -- thermodynamic integration of the likelihood expectation per temperature
+      storage_logZ(lLikelihood_accumulators, temperature, iStoragetoChain, nchains, lLikelihood_expectation, lLikelihood_deviation, &logZ, &logZe);
       printf("Output -- Final logZ: %f +/- %f\n", logZ, logZe);
+      if (use_stepping_stone == TRUE)
+      {
+        compute_logZ_ss(saved_lLikelihood, temperature, iStoragetoChain, nchains, niter, ceil(0.3 * niter), &logZ_ss, &logZ_ss_err);
+        printf("Output -- Stepping-stone logZ: %f +/- %f\n", logZ_ss, logZ_ss_err);
+      }
       burn_in_times[0] = ceil(0.3*niter);
       mcmc_results(minimization_engine, output_filename, nchains, burn_in_times, depth, nelements, axis_len, xtransform, ytransform, saved_x, saved_y,
                              saved_params, niter, nwavr, final_params, final_params_std, reg_param, final_reg_value, prior_image, initial_x, initial_y, centroid_image_x,
@@ -1497,7 +2064,9 @@ int main(int argc, char **argv)
 
   fflush(stdout);
 
+  free_channel_index();
   free(uvwav2chan);
+  free(chan_uv_start);
   free(uvtime2chan);
   free(wavmax);
   free(wavmin);
@@ -1507,6 +2076,8 @@ int main(int argc, char **argv)
   free(saved_params);
   free(lLikelihood_expectation);
   free(lLikelihood_deviation);
+  free(lLikelihood_accumulators);
+  free(chain_contexts);
   free(saved_lLikelihood);
   free(saved_lPrior);
   free(saved_lPosterior);
@@ -1515,9 +2086,33 @@ int main(int argc, char **argv)
   free(temperature);
   free(iChaintoStorage);
   free(iStoragetoChain);
-  free(iMovedChain);
+  free(swap_slots);
+  free(round_trips);
+  free(round_trip_iterations);
+  free(swap_rates);
+  free(population);
+  free(population_lLikelihood);
+  free(population_ancestor);
+  if (population_rng != NULL)
+    RngStream_DeleteStream(&population_rng);
   free(xtransform);
   free(ytransform);
+  free(xphasor_base);
+  free(yphasor_base);
+  free(xtransform_f);
+  free(ytransform_f);
+  for (i = 0; (node_xtransform != NULL) && (i < topo.nnodes); ++i)
+  {
+    free(node_xtransform[i]);
+    free(node_ytransform[i]);
+    free(node_xtransform_f[i]);
+    free(node_ytransform_f[i]);
+  }
+  free(node_xtransform);
+  free(node_ytransform);
+  free(node_xtransform_f);
+  free(node_ytransform_f);
+  free_numa_topology(&topo);
   free(visin);
   free(v2in);
   free(t3in1);
@@ -1541,6 +2136,9 @@ int main(int argc, char **argv)
   free(initial_x);
   free(initial_y);
   free(prior_image);
+#ifdef SQUEEZE_MPI
+  MPI_Finalize();
+#endif
   return 0;
 }
 
@@ -1576,6 +2174,18 @@ void printhelp(void)
   printf("  -threads N     : Number of simultaneous threads SQUEEZE is allowed to use, has to be at least equal to nchains\n");
   printf("  -tempschedc c  : Temperature schedule power c for parallel tempering (default = 3).\n");
   printf("  -nobws         : Do not compute bandwidth smearing factors when computing visibilities.\n");
+  printf("  -noearlyreject : Always evaluate the full chi2 of a proposal before the Metropolis test.\n");
+  printf("  -numa          : Replicate the phasor tables on each NUMA node and pin each chain to cpus of its node.\n");
+  printf("  -quantum N     : With more chains than threads, number of iterations a chain runs before yielding its thread (default %d).\n", DEFAULT_CHAIN_QUANTUM);
+  printf("  -parthreshold N: Smallest number of uv points or observables for which a chain splits its loops across its threads (default %d).\n", DEFAULT_PAR_THRESHOLD);
+  printf("  -adaptladder   : Parallel tempering -- tune the temperature ladder toward uniform swap rates until burn-in (30%% of the iterations).\n");
+  printf("  -deo           : Parallel tempering -- deterministic even/odd swap schedule (non-reversible) instead of random neighbours.\n");
+  printf("  -steppingstone : Parallel tempering -- also estimate logZ with the stepping-stone estimator, with bootstrap errors.\n");
+  printf("  -popanneal     : Population annealing -- the chains are cooled together to T = 1 until 30%% of the iterations, resampled by likelihood at each step.\n");
+  printf("  -phasormem MB  : Memory budget for the phasor tables, above which phasors are generated on the fly (default %d MB).\n", DEFAULT_PHASOR_MEMORY);
+  printf("  -mtm K         : Multiple-try Metropolis, evaluating K candidate positions per element move (2 <= K <= %d).\n", MTM_MAX_TRIES);
+  printf("  -floatphasors N: Use single-precision phasor tables for element moves, recomputing visibilities in double every N iterations.\n");
+  printf("  -resync N      : Recompute visibilities from scratch every N iterations, logging the drift and chi2 correction.\n");
 
   printf("\n***** OUTPUT SETTINGS ***** \n");
   printf("  -o filename     : Squeeze outputs as a FITS image file.\n");
@@ -1628,8 +2238,10 @@ void printhelp(void)
   printf("  -l1CDF53 param     : CDF53 wavelet sparsity (l1 norm).\n");
   printf("  -l0CDF97 param     : CDF97 wavelet sparsity (l0 norm).\n");
   printf("  -l1CDF97 param     : CDF97 wavelet sparsity (l1 norm).\n");
+  printf("  -cdflevels N       : Decomposition levels of the CDF wavelets (default 1).\n");
   printf("  -l0ATROUS param    : A trous wavelet sparsity (l0 norm).\n");
   printf("  -l1ATROUS param    : A trous wavelet sparsity (l1 norm).\n");
+  printf("  -atrousscales N    : Scales of the a trous wavelets, smoothed image included (default 4).\n");
   printf("  -en param     : Entropy regularization multiplier.\n");
   printf("  -de param     : Dark energy regularization multiplier.\n");
   printf("  -ud param     : Uniform disc regularization multiplier.\n");
@@ -1659,6 +2271,8 @@ void printhelp(void)
 
 /**********************************************************************/
 /* Calculate complex vis chi^2 taking into account the known_phases   */
+/* Materializes mod_obs and res, only needed for the .data output;    */
+/* the main loop uses the fused compute_chi2_chan instead             */
 /**********************************************************************/
 void compute_lLikelihood(double *likelihood, const double complex *__restrict mod_vis, double *__restrict res, double *__restrict mod_obs, double *chi2v2, double *chi2t3amp, double *chi2visamp, double *chi2t3phi, double *chi2visphi, const int nwavr)
 {
@@ -1802,6 +2416,297 @@ double residuals_to_chi2(const double *res, double *chi2v2, double *chi2t3amp, d
   return temp1 + temp2 + temp3 + temp4 + temp5;
 }
 
+/**********************************************************************/
+/* Per-channel observable index                                       */
+/* An element move in channel w only changes the uv points with       */
+/* uvwav2chan == w, hence only the observables listed for w.           */
+/**********************************************************************/
+static void build_chan_list(const long nobs, const long *uvin, const int nwavr, long **off, long **idx)
+{
+  long i, w;
+  long *cursor = malloc((nwavr + 1) * sizeof(long));
+  *off = calloc(nwavr + 2, sizeof(long));
+  *idx = malloc((nobs > 0 ? nobs : 1) * sizeof(long));
+
+  for (i = 0; i < nobs; ++i)
+  {
+    w = uvwav2chan[uvin[i]];
+    if (w < 0)
+      w = nwavr;
+    (*off)[w + 1]++;
+  }
+
+  for (w = 0; w < nwavr + 1; ++w)
+  {
+    (*off)[w + 1] += (*off)[w];
+    cursor[w] = (*off)[w];
+  }
+
+  for (i = 0; i < nobs; ++i)
+  {
+    w = uvwav2chan[uvin[i]];
+    if (w < 0)
+      w = nwavr;
+    (*idx)[cursor[w]++] = i;
+  }
+  free(cursor);
+}
+
+void build_channel_index(const int nwavr)
+{
+  // all three uv points of a T3 share the same wavelength, so t3in1 is enough to find the channel
+  build_chan_list(nv2, v2in, nwavr, &v2_chan_off, &v2_chan_idx);
+  build_chan_list(nt3, t3in1, nwavr, &t3_chan_off, &t3_chan_idx);
+  build_chan_list(nvisamp, visin, nwavr, &visamp_chan_off, &visamp_chan_idx);
+  build_chan_list(nvisphi, visin, nwavr, &visphi_chan_off, &visphi_chan_idx);
+
+  // differential phases reference all the channels of a record, so a move anywhere changes them
+  use_chan_likelihood = !((diffvis == TRUE) && (nvisphi > 0));
+
+  if (use_chan_likelihood == TRUE)
+    printf("Reconst setup -- Channel-local likelihood:\tenabled\n");
+  else
+    printf("Reconst setup -- Channel-local likelihood:\tdisabled (differential phases)\n");
+
+  if (use_early_rejection == TRUE)
+    printf("Reconst setup -- Early rejection:\tenabled\n");
+  else
+    printf("Reconst setup -- Early rejection:\tdisabled\n");
+}
+
+void free_channel_index(void)
+{
+  free(v2_chan_off);
+  free(t3_chan_off);
+  free(visamp_chan_off);
+  free(visphi_chan_off);
+  free(v2_chan_idx);
+  free(t3_chan_idx);
+  free(visamp_chan_idx);
+  free(visphi_chan_idx);
+}
+
+/**********************************************************************/
+/* Chi^2 partials (V2, T3AMP, VISAMP, T3PHI, VISPHI) of one channel   */
+/* chan = nwavr designates the observables outside all channels        */
+/**********************************************************************/
+void compute_chi2_chan(double *chi2_chan, const double complex *__restrict mod_vis, const long chan, const int nwavr)
+{
+  compute_chi2_chan_bounded(chi2_chan, mod_vis, chan, nwavr, HUGE_VAL);
+}
+
+/**********************************************************************/
+/* Fused single pass from visibilities to chi^2: each observable is   */
+/* converted, compared and summed in registers, mod_obs and res are   */
+/* never written (see compute_lLikelihood for the .data output).      */
+/* The evaluation stops as soon as the partial chi2 exceeds           */
+/* chi2_bound. Returns the partial chi2 of the channel, which is only */
+/* complete (and stored in chi2_chan) when it does not exceed it.     */
+/**********************************************************************/
+double compute_chi2_chan_bounded(double *chi2_chan, const double complex *__restrict mod_vis, const long chan, const int nwavr, const double chi2_bound)
+{
+  long i, k, n;
+  double complex modt3;
+  double r, ref_chan;
+  double temp1 = 0, temp2 = 0, temp3 = 0, temp4 = 0, temp5 = 0; // local accumulators
+  const long t3ampoffset = nv2;
+  const long visampoffset = nv2 + nt3amp;
+  const long t3phioffset = nv2 + nt3amp + nvisamp;
+  const long visphioffset = nv2 + nt3amp + nvisamp + nt3phi;
+
+  if (chi2_bound < 0.) // chi2 >= 0, nothing can be accepted
+    return 0.;
+
+  if ((chain_threads > 1) && (v2_chan_off[chan + 1] - v2_chan_off[chan] + t3_chan_off[chan + 1] - t3_chan_off[chan] + visamp_chan_off[chan + 1]
+                              - visamp_chan_off[chan] + visphi_chan_off[chan + 1] - visphi_chan_off[chan] >= par_threshold))
+    return compute_chi2_chan_team(chi2_chan, mod_vis, chan, nwavr, chi2_bound);
+
+  for (n = v2_chan_off[chan]; n < v2_chan_off[chan + 1]; ++n)
+  {
+    i = v2_chan_idx[n];
+    r = (modsq(mod_vis[v2in[i]]) - data[i]) * data_err[i];
+    temp1 += r * r;
+    if (((n % EARLY_REJECT_BLOCK) == 0) && (temp1 > chi2_bound))
+      return temp1;
+  }
+
+  for (n = t3_chan_off[chan]; n < t3_chan_off[chan + 1]; ++n)
+  {
+    i = t3_chan_idx[n];
+    modt3 = mod_vis[ t3in1[i] ] * mod_vis[ t3in2[i] ] * conj(mod_vis[ t3in3[i] ]);
+
+    if ((i < nt3amp) && (data_err[t3ampoffset + i] > 0))
+    {
+      r = (cabs(modt3) - data[t3ampoffset + i]) * data_err[t3ampoffset + i];
+      temp2 += r * r;
+    }
+
+    if ((i < nt3phi) && (data_err[t3phioffset + i] > 0))
+    {
+      r = dewrap(carg(modt3) - data[t3phioffset + i]) * data_err[t3phioffset + i];
+      temp5 += r * r;
+    }
+
+    if (((n % EARLY_REJECT_BLOCK) == 0) && (temp1 + temp2 + temp5 > chi2_bound))
+      return temp1 + temp2 + temp5;
+  }
+
+  for (n = visamp_chan_off[chan]; n < visamp_chan_off[chan + 1]; ++n)
+  {
+    i = visamp_chan_idx[n];
+    if (data_err[visampoffset + i] > 0)
+    {
+      r = (cabs(mod_vis[ visin[i] ]) - data[visampoffset + i]) * data_err[visampoffset + i];
+      temp3 += r * r;
+    }
+  }
+
+  if (temp1 + temp2 + temp3 + temp5 > chi2_bound)
+    return temp1 + temp2 + temp3 + temp5;
+
+  for (n = visphi_chan_off[chan]; n < visphi_chan_off[chan + 1]; ++n)
+  {
+    i = visphi_chan_idx[n];
+    if (data_err[visphioffset + i] > 0)
+    {
+      if (diffvis == FALSE)
+        r = carg(mod_vis[ visin[i] ]);
+      else
+      {
+        ref_chan = 0;
+        for (k = 0; k < nwavr; k++)
+          if (dvisindx[i][k] != -1)
+            ref_chan += carg(mod_vis[ dvisindx[i][k] ]);
+        ref_chan /= (double)dvisnwav[i];
+        r = carg(mod_vis[ visin[i] ]) - ref_chan;
+      }
+      r = dewrap(r - data[visphioffset + i]) * data_err[visphioffset + i];
+      temp4 += r * r;
+    }
+  }
+
+  chi2_chan[CHI2_V2] = temp1;
+  chi2_chan[CHI2_T3AMP] = temp2;
+  chi2_chan[CHI2_VISAMP] = temp3;
+  chi2_chan[CHI2_VISPHI] = temp4;
+  chi2_chan[CHI2_T3PHI] = temp5;
+  return temp1 + temp2 + temp3 + temp4 + temp5;
+}
+
+// Same partials, with each observable loop split across the chain's thread team.
+// The early rejection bound is only tested between observable types
+double compute_chi2_chan_team(double *chi2_chan, const double complex *__restrict mod_vis, const long chan, const int nwavr, const double chi2_bound)
+{
+  double temp1 = 0, temp2 = 0, temp3 = 0, temp4 = 0, temp5 = 0;
+  const long t3ampoffset = nv2;
+  const long visampoffset = nv2 + nt3amp;
+  const long t3phioffset = nv2 + nt3amp + nvisamp;
+  const long visphioffset = nv2 + nt3amp + nvisamp + nt3phi;
+
+  #pragma omp parallel num_threads(chain_threads)
+  {
+    long i, k, n;
+    double complex modt3;
+    double r, ref_chan;
+
+    #pragma omp for schedule(static) reduction(+:temp1)
+    for (n = v2_chan_off[chan]; n < v2_chan_off[chan + 1]; ++n)
+    {
+      i = v2_chan_idx[n];
+      r = (modsq(mod_vis[v2in[i]]) - data[i]) * data_err[i];
+      temp1 += r * r;
+    }
+
+    // the reductions are complete after each loop, so every thread takes the same branch
+    if (temp1 <= chi2_bound)
+    {
+      #pragma omp for schedule(static) reduction(+:temp2, temp5)
+      for (n = t3_chan_off[chan]; n < t3_chan_off[chan + 1]; ++n)
+      {
+        i = t3_chan_idx[n];
+        modt3 = mod_vis[ t3in1[i] ] * mod_vis[ t3in2[i] ] * conj(mod_vis[ t3in3[i] ]);
+        if ((i < nt3amp) && (data_err[t3ampoffset + i] > 0))
+        {
+          r = (cabs(modt3) - data[t3ampoffset + i]) * data_err[t3ampoffset + i];
+          temp2 += r * r;
+        }
+        if ((i < nt3phi) && (data_err[t3phioffset + i] > 0))
+        {
+          r = dewrap(carg(modt3) - data[t3phioffset + i]) * data_err[t3phioffset + i];
+          temp5 += r * r;
+        }
+      }
+
+      #pragma omp for schedule(static) reduction(+:temp3)
+      for (n = visamp_chan_off[chan]; n < visamp_chan_off[chan + 1]; ++n)
+      {
+        i = visamp_chan_idx[n];
+        if (data_err[visampoffset + i] > 0)
+        {
+          r = (cabs(mod_vis[ visin[i] ]) - data[visampoffset + i]) * data_err[visampoffset + i];
+          temp3 += r * r;
+        }
+      }
+
+      if (temp1 + temp2 + temp3 + temp5 <= chi2_bound)
+      {
+        #pragma omp for schedule(static) reduction(+:temp4)
+        for (n = visphi_chan_off[chan]; n < visphi_chan_off[chan + 1]; ++n)
+        {
+          i = visphi_chan_idx[n];
+          if (data_err[visphioffset + i] > 0)
+          {
+            if (diffvis == FALSE)
+              r = carg(mod_vis[ visin[i] ]);
+            else
+            {
+              ref_chan = 0;
+              for (k = 0; k < nwavr; k++)
+                if (dvisindx[i][k] != -1)
+                  ref_chan += carg(mod_vis[ dvisindx[i][k] ]);
+              ref_chan /= (double)dvisnwav[i];
+              r = carg(mod_vis[ visin[i] ]) - ref_chan;
+            }
+            r = dewrap(r - data[visphioffset + i]) * data_err[visphioffset + i];
+            temp4 += r * r;
+          }
+        }
+      }
+    }
+  }
+
+  if (temp1 + temp2 + temp3 + temp5 > chi2_bound)
+    return temp1 + temp2 + temp3 + temp5;
+
+  chi2_chan[CHI2_V2] = temp1;
+  chi2_chan[CHI2_T3AMP] = temp2;
+  chi2_chan[CHI2_VISAMP] = temp3;
+  chi2_chan[CHI2_VISPHI] = temp4;
+  chi2_chan[CHI2_T3PHI] = temp5;
+  return temp1 + temp2 + temp3 + temp4 + temp5;
+}
+
+// Sums the cached partials of all channels (including the out-of-channel slot)
+double sum_chi2_chan(const double *chi2_chan, const int nwavr, double *chi2v2, double *chi2t3amp, double *chi2visamp, double *chi2t3phi, double *chi2visphi)
+{
+  long w;
+  double temp[NCHI2] = {0, 0, 0, 0, 0};
+  for (w = 0; w < nwavr + 1; ++w)
+  {
+    temp[CHI2_V2] += chi2_chan[w * NCHI2 + CHI2_V2];
+    temp[CHI2_T3AMP] += chi2_chan[w * NCHI2 + CHI2_T3AMP];
+    temp[CHI2_VISAMP] += chi2_chan[w * NCHI2 + CHI2_VISAMP];
+    temp[CHI2_T3PHI] += chi2_chan[w * NCHI2 + CHI2_T3PHI];
+    temp[CHI2_VISPHI] += chi2_chan[w * NCHI2 + CHI2_VISPHI];
+  }
+  *chi2v2 = temp[CHI2_V2];
+  *chi2t3amp = temp[CHI2_T3AMP];
+  *chi2visamp = temp[CHI2_VISAMP];
+  *chi2t3phi = temp[CHI2_T3PHI];
+  *chi2visphi = temp[CHI2_VISPHI];
+  return temp[CHI2_V2] + temp[CHI2_T3AMP] + temp[CHI2_VISAMP] + temp[CHI2_T3PHI] + temp[CHI2_VISPHI];
+}
+
 static inline double dewrap(double diff) //__attribute__((always_inline))
 {
   if (diff < -M_PI)
@@ -1823,12 +2728,11 @@ static inline double modsq(double complex input) // __attribute__((always_inline
 /**********************************************************/
 double get_flat_chi2(bool benchmark, const int nwavr)
 {
-  long i, rlong, nbench;
+  long i, w, rlong, nbench;
   double dummy1, dummy2, dummy3, dummy4, dummy5, startTime, endTime;
   double complex
   *mod_vis = malloc(nuv * sizeof(double complex));
-  double *res = malloc((nv2 + nt3amp + nt3phi + nvisamp + nvisphi) * sizeof(double)); // current residuals
-  double *mod_obs = malloc((nv2 + nt3amp + nt3phi + nvisamp + nvisphi) * sizeof(double)); // current observables
+  double *chi2_chan = malloc((nwavr + 1) * NCHI2 * sizeof(double));
   RngStream rngflat = RngStream_CreateStream("flatchi2");
   for (i = 0; i < nuv; ++i)
   {
@@ -1847,15 +2751,18 @@ double get_flat_chi2(bool benchmark, const int nwavr)
   double flat_chi2 = 0;
   startTime = (double) clock() / CLOCKS_PER_SEC;
   for (i = 0; i < nbench; ++i)
-    compute_lLikelihood(&flat_chi2, mod_vis, res, mod_obs, &dummy1, &dummy2, &dummy3, &dummy4, &dummy5, nwavr);
+  {
+    for (w = 0; w < nwavr + 1; ++w)
+      compute_chi2_chan(&chi2_chan[w * NCHI2], mod_vis, w, nwavr);
+    flat_chi2 = 0.5 * sum_chi2_chan(chi2_chan, nwavr, &dummy1, &dummy2, &dummy3, &dummy4, &dummy5);
+  }
 
   endTime = (double) clock() / CLOCKS_PER_SEC;
   if (benchmark == TRUE)
     printf("Reconst setup -- %ld iterations in %f seconds = %f it/sec for this datafile\n", nbench, endTime - startTime,
            (double) nbench / (endTime - startTime));
 
-  free(res);
-  free(mod_obs);
+  free(chi2_chan);
   free(mod_vis);
   RngStream_DeleteStream(&rngflat);
   if (benchmark == TRUE)
@@ -2025,6 +2932,20 @@ int writeasfits(const char *file, double *image, int nwavr, long depth, long min
     printerror(status);
   if (fits_update_key(fptr, TDOUBLE, "LOGZE", &logZ_err, "Error on Marginal likelihood", &status))
     printerror(status);
+  if (use_stepping_stone == TRUE)
+  {
+    if (fits_update_key(fptr, TDOUBLE, "LOGZSS", &logZ_ss, "Marginal likelihood (stepping-stone)", &status))
+      printerror(status);
+    if (fits_update_key(fptr, TDOUBLE, "LOGZSSE", &logZ_ss_err, "Bootstrap error on stepping-stone logZ", &status))
+      printerror(status);
+  }
+  if (nswap_pairs > 0)
+  {
+    if (fits_update_key(fptr, TLONG, "NRTRIP", &total_round_trips, "Round trips between coldest and hottest T", &status))
+      printerror(status);
+    if (fits_update_key(fptr, TDOUBLE, "RTRIPIT", &mean_round_trip, "Mean round trip duration (iterations)", &status))
+      printerror(status);
+  }
   if (fits_update_key(fptr, TSTRING, "INITIM", init_filename, "Initialization image.", &status))
     printerror(status);
   if (fits_update_key(fptr, TSTRING, "PRIORIM", prior_filename, "Prior image.", &status))
@@ -2054,6 +2975,24 @@ int writeasfits(const char *file, double *image, int nwavr, long depth, long min
   if (fits_update_key(fptr, TLONG,   "NVISPHI", &nvisphi, "Number of VISPHI", &status))
     printerror(status);
 
+  if (nswap_pairs > 0)
+  {
+    // One row per pair of adjacent temperatures, as there can be more pairs than 8-character keywords can number
+    char *swap_ttype[] = { "PAIR", "SWAPRATE" }, *swap_tform[] = { "1J", "1D" }, *swap_tunit[] = { "", "" };
+    int *swap_pair = malloc(nswap_pairs * sizeof(int));
+    for (int p = 0; p < nswap_pairs; ++p)
+      swap_pair[p] = p;
+    if (fits_create_tbl(fptr, BINARY_TBL, nswap_pairs, 2, swap_ttype, swap_tform, swap_tunit, "SWAPRATE", &status))
+      printerror(status);
+    if (fits_write_comment(fptr, "Swap rate of temperatures PAIR, PAIR+1 after burn-in", &status))
+      printerror(status);
+    if (fits_write_col(fptr, TINT, 1, 1, 1, nswap_pairs, swap_pair, &status))
+      printerror(status);
+    if (fits_write_col(fptr, TDOUBLE, 2, 1, 1, nswap_pairs, swap_rates, &status))
+      printerror(status);
+    free(swap_pair);
+  }
+
   if (fits_close_file(fptr, &status)) /* close the file */
     printerror(status);
 
@@ -2181,6 +3120,63 @@ void compute_logZ(const double *temperature, const unsigned short *iStoragetoCha
 
 }
 
+// log of the mean of exp(-dbeta * lLikelihood) over the given rows, shifted by its largest exponent to avoid overflow
+double stepping_stone_log_ratio(const double *lLikelihood, const long *rows, const long nrows, const double dbeta)
+{
+  long j;
+  double shift = -dbeta * lLikelihood[rows[0]];
+  double sum = 0;
+  for (j = 1; j < nrows; ++j)
+    if (-dbeta * lLikelihood[rows[j]] > shift)
+      shift = -dbeta * lLikelihood[rows[j]];
+  for (j = 0; j < nrows; ++j)
+    sum += exp(-dbeta * lLikelihood[rows[j]] - shift);
+  return shift + log(sum / nrows);
+}
+
+void compute_logZ_ss(const double *saved_lLikelihood, const double *temperature, const unsigned short *iStoragetoChain, const int nchains, const long niter,
+                     const long burn_in, double *logZ, double *logZ_err)
+{
+  long b, j, k, s;
+  const long nrows = niter - burn_in;
+  const long block = ceil(sqrt((double) nrows));
+  double total, sum = 0, sum2 = 0;
+  *logZ = 0;
+  *logZ_err = 0;
+  if ((nrows < 1) || (nchains < 2))
+    return;
+  long *rows = malloc(nrows * sizeof(long));
+  for (j = 0; j < nrows; ++j)
+    rows[j] = burn_in + j;
+  // storage s + 1 samples the hotter side of the ratio Z(1/T_s) / Z(1/T_s+1)
+  for (s = 0; s < nchains - 1; ++s)
+    *logZ += stepping_stone_log_ratio(&saved_lLikelihood[(s + 1) * niter], rows, nrows,
+                                      1. / temperature[iStoragetoChain[s]] - 1. / temperature[iStoragetoChain[s + 1]]);
+
+  RngStream bootrng = RngStream_CreateStream("bootstrap");
+  for (b = 0; b < SS_BOOTSTRAP; ++b)
+  {
+    total = 0;
+    for (s = 0; s < nchains - 1; ++s)
+    {
+      for (j = 0; j < nrows; j += block)
+      {
+        const long start = RngStream_RandInt(bootrng, 0, nrows - 1);
+        for (k = 0; (k < block) && (j + k < nrows); ++k)
+          rows[j + k] = burn_in + (start + k) % nrows;
+      }
+      total += stepping_stone_log_ratio(&saved_lLikelihood[(s + 1) * niter], rows, nrows,
+                                        1. / temperature[iStoragetoChain[s]] - 1. / temperature[iStoragetoChain[s + 1]]);
+    }
+    sum += total;
+    sum2 += total * total;
+  }
+  RngStream_DeleteStream(&bootrng);
+  free(rows);
+  sum /= SS_BOOTSTRAP;
+  *logZ_err = sqrt(fmax(sum2 / SS_BOOTSTRAP - sum * sum, 0) * SS_BOOTSTRAP / (SS_BOOTSTRAP - 1));
+}
+
 //
 void mcmc_fullchain(char *file, long nchains, long niter, int nwavr, long nelements, unsigned short axis_len, unsigned short *saved_x, unsigned short *saved_y,
                     double *saved_params, double *saved_lLikelihood, double *saved_lPrior, double *saved_lPosterior, double *temperature, unsigned short *iChaintoStorage)
@@ -2302,7 +3298,7 @@ void mcmc_fullchain(char *file, long nchains, long niter, int nwavr, long neleme
 // then dump the info into .fits (+headers) and .data files
 //
 void mcmc_writeoutput(char *file_basename, double *image, const int nchains, const int nrealizations, const unsigned int *burn_in_times, const long depth, const long nelements, const unsigned short axis_len,
-                      const double complex *__restrict xtransform, const double complex *__restrict ytransform, const unsigned short *saved_x, const unsigned short *saved_y, const double *saved_params, const long niter,
+                      const double *__restrict xtransform, const double *__restrict ytransform, const unsigned short *saved_x, const unsigned short *saved_y, const double *saved_params, const long niter,
                       const int nwavr, double *params, double *params_std, double *reg_param, double *reg_value, const double *prior_image, const unsigned short *initial_x, const unsigned short *initial_y,
                       double *centroid_image_x, double *centroid_image_y, const double fov, const double cent_mult, const int ndf, double tmin, double chi2_temp, double chi2_target, double mas_pixel, char *init_filename, char *prior_filename,
 		      double logZ, double logZe)
@@ -2402,7 +3398,7 @@ void mcmc_writeoutput(char *file_basename, double *image, const int nchains, con
   // Recompute regularizers
   //
 
-  compute_regularizers(reg_param, reg_value, image, prior_image, 1., initial_x, initial_y, nwavr, axis_len, nelements, centroid_image_x, centroid_image_y, fov, cent_mult);
+  compute_regularizers(reg_param, reg_value, image, prior_image, 1., initial_x, initial_y, nwavr, axis_len, nelements, centroid_image_x, centroid_image_y, fov, cent_mult, NULL);
 
   //
   // Now write to fits file
@@ -2476,7 +3472,7 @@ void register_image_mse(double *in_image, double *out_image, int nx, int ny, int
 //
 ////////////////////////////////
 void mcmc_results(int minimization_engine, char *file_basename, const int nchains, const unsigned int *burn_in_times, const long depth, const long nelements, const unsigned short axis_len,
-		  const double complex *__restrict xtransform, const double complex *__restrict ytransform,
+		  const double *__restrict xtransform, const double *__restrict ytransform,
 		  const unsigned short *saved_x, const unsigned short *saved_y, const double *saved_params, const long niter,
 		  const int nwavr, double *final_params, double *final_params_std,
 		  double *reg_param, double *final_reg_value, const double *prior_image, const unsigned short *initial_x, const unsigned short *initial_y,
@@ -2490,7 +3486,7 @@ void mcmc_results(int minimization_engine, char *file_basename, const int nchain
 
   // Cheat for tempering
   int nchains_eff;
-  if(minimization_engine == ENGINE_SIMULATED_ANNEALING)
+  if(minimization_engine != ENGINE_PARALLEL_TEMPERING) // annealing: all chains sample the target after their burn-in
     {
       nchains_eff = nchains;
     }
@@ -2683,136 +3679,833 @@ void mcmc_results(int minimization_engine, char *file_basename, const int nchain
 
 
 
-inline void swapi(unsigned short *a, unsigned short *b)
+// Takes over the temperature and storage the partner published on its side of the slot
+void swap_apply(swap_slot *slot, const int side, const int iChain, double *temperature, unsigned short *iChaintoStorage, unsigned short *iStoragetoChain)
 {
-  unsigned short tmp = *a;
-  *a = *b;
-  *b = tmp;
+  temperature[iChain] = atomic_load(&slot->temperature[1 - side]);
+  iChaintoStorage[iChain] = atomic_load(&slot->storage[1 - side]);
+  iStoragetoChain[iChaintoStorage[iChain]] = iChain;
 }
 
-inline void swapd(double *a, double *b)
+// Answers the offer of the partner on side 1 - side of slot pair, posted as state at this boundary. Returns TRUE if the swap was accepted,
+// in which case it has already taken effect for this chain
+bool swap_answer(swap_slot *slots, const long pair, const int side, long state, const long boundary, const int iChain, const int nchains, const double lPosterior,
+                 RngStream rng, double *temperature, unsigned short *iChaintoStorage, unsigned short *iStoragetoChain, const long burn_in)
 {
-  double tmp = *a;
-  *a = *b;
-  *b = tmp;
+  swap_slot *slot = &slots[pair];
+  // Inter-chain Metropolis-Hastings temperature swap, the partner waits with the state it offered
+  const double partner_temperature = atomic_load(&slot->temperature[1 - side]);
+  const double transition_test = (1. / temperature[iChain] - 1. / partner_temperature) * (lPosterior - atomic_load(&slot->lPosterior[1 - side]));
+  const bool accepted = (log(RngStream_RandU01(rng)) < transition_test);
+  atomic_store(&slot->temperature[side], temperature[iChain]);
+  atomic_store(&slot->storage[side], iChaintoStorage[iChain]);
+  const long answer = boundary * 4 + (accepted ? SWAP_ACCEPTED : SWAP_REJECTED);
+  if (atomic_compare_exchange_strong(&slot->offer[1 - side], &state, answer) == FALSE)
+    return FALSE; // withdrawn in the meantime
+  while (atomic_load(&slot->offer[1 - side]) == answer) // the partner takes the answer before either goes on, which frees the word for the next offers
+    sched_yield();
+  if ((use_adaptive_ladder == TRUE) && (boundary < burn_in))
+    adapt_ladder(slots, nchains, pair, boundary, (transition_test < 0) ? exp(transition_test) : 1.0);
+  if (boundary >= burn_in)
+  {
+    atomic_fetch_add(&slot->attempts, 1);
+    if (accepted == TRUE)
+      atomic_fetch_add(&slot->accepts, 1);
+  }
+  if (accepted == TRUE)
+  {
+    printf("Swap called from chain %d -- swapping temperatures %f and %f at iteration %ld\n", iChain, temperature[iChain], partner_temperature, boundary);
+    swap_apply(slot, side, iChain, temperature, iChaintoStorage, iStoragetoChain);
+  }
+  return accepted;
 }
 
-double sinc(double x)
+// Answers the offer of a neighbour in temperature posted at this boundary, or posts an offer to it. Returns TRUE if an offer was
+// posted, which swap_wait has to see through before the chain goes on
+bool swap_attempt(swap_slot *slots, swap_pending *pending, const long boundary, const int iChain, const int nchains, const double lPosterior, RngStream rng,
+                  double *temperature, unsigned short *iChaintoStorage, unsigned short *iStoragetoChain, const long burn_in)
 {
-  return sin(x + 1e-15) / (x + 1e-15);
+  const long storage = iChaintoStorage[iChain];
+  long pair, state;
+  pending->pair = -1;
+  // Even/odd pairs alternate with the boundary, so that a replica keeps moving in the direction of its last swap. Offers are only
+  // answered at the boundary they were posted at, which is thus a round shared by both chains: storage p and p + 1 pick pair p
+  // at the same rounds, and neither can be busy with its other neighbour then
+  if (use_deo_swaps == TRUE)
+    pair = (((storage + boundary) % 2) == 0) ? storage : storage - 1;
+  else
+  {
+    pair = (RngStream_RandU01(rng) < 0.5) ? storage : storage - 1; // neighbour above or below, unless one of them has an offer to answer
+    state = ((storage < nchains - 1) ? atomic_load(&slots[storage].offer[1]) : 0);
+    if (state == boundary * 4 + SWAP_OFFERED)
+      pair = storage;
+    state = ((storage > 0) ? atomic_load(&slots[storage - 1].offer[0]) : 0);
+    if (state == boundary * 4 + SWAP_OFFERED)
+      pair = storage - 1;
+  }
+  if ((pair < 0) || (pair >= nchains - 1))
+    return FALSE;
+  swap_slot *slot = &slots[pair];
+  const int side = storage - pair;
+  state = atomic_load(&slot->offer[1 - side]);
+  if (state == boundary * 4 + SWAP_OFFERED)
+  {
+    swap_answer(slots, pair, side, state, boundary, iChain, nchains, lPosterior, rng, temperature, iChaintoStorage, iStoragetoChain, burn_in);
+    return FALSE;
+  }
+
+  // post our offer
+  atomic_store(&slot->lPosterior[side], lPosterior);
+  atomic_store(&slot->temperature[side], temperature[iChain]);
+  atomic_store(&slot->storage[side], storage);
+  state = 0;
+  if (atomic_compare_exchange_strong(&slot->offer[side], &state, boundary * 4 + SWAP_OFFERED) == FALSE)
+    return FALSE;
+  pending->pair = pair;
+  pending->side = side;
+  return TRUE;
 }
 
-void intHandler(int signum)
+// Waits for the partner to answer the offer posted at this boundary, or to get past the boundary without answering, in which case
+// the offer is withdrawn. Two chains offering to each other would wait forever: the one on side 0 withdraws and answers instead
+void swap_wait(swap_slot *slots, swap_pending *pending, const long boundary, const int iChain, const int nchains, const double lPosterior, RngStream rng,
+               double *temperature, unsigned short *iChaintoStorage, unsigned short *iStoragetoChain, const long burn_in)
 {
-  printf("\nExiting at next opportunity\n");
-  if (ctrlcpressed == TRUE)
-    exit(0);
-  else
-    ctrlcpressed = TRUE;
+  const long pair = pending->pair;
+  const int side = pending->side;
+  swap_slot *slot = &slots[pair];
+  long state, partner_state;
+  pending->pair = -1;
+  for (;;)
+  {
+    state = atomic_load(&slot->offer[side]);
+    if ((state & 3) != SWAP_OFFERED)
+    {
+      if ((state & 3) == SWAP_ACCEPTED)
+        swap_apply(slot, side, iChain, temperature, iChaintoStorage, iStoragetoChain);
+      atomic_store(&slot->offer[side], 0);
+      return;
+    }
+    partner_state = atomic_load(&slot->offer[1 - side]);
+    if ((atomic_load(&slots[pair + 1 - side].passed) >= boundary)
+        || ((side == 0) && (partner_state == boundary * 4 + SWAP_OFFERED)))
+      if (atomic_compare_exchange_strong(&slot->offer[side], &state, 0))
+      {
+        if ((side == 0) && (partner_state == boundary * 4 + SWAP_OFFERED))
+          swap_answer(slots, pair, side, partner_state, boundary, iChain, nchains, lPosterior, rng, temperature, iChaintoStorage, iStoragetoChain, burn_in);
+        return;
+      }
+    sched_yield();
+  }
+}
 
+// Log-spacings of the initial ladder T[p] = (nchains / (nchains - p))^tempschedc
+void init_ladder(swap_slot *slots, const int nchains, const double tempschedc)
+{
+  long p;
+  for (p = 0; p < nchains - 1; ++p)
+    atomic_store(&slots[p].log_spacing, log(tempschedc * log((double)(nchains - p) / (double)(nchains - p - 1))));
 }
 
-void compute_regularizers(const double *reg_param, double *reg_value, const double *image, const double *prior_image, const double fluxscaling,
-                          const unsigned short *initial_x, const unsigned short *initial_y, const int nwavr, const unsigned short axis_len, const long nelements,
-                          double *centroid_image_x, double *centroid_image_y, const double fov, const double cent_mult)
+// Temperature of a storage: log T grows from 0 (storage 0) to log_tmax (storage nchains - 1) by the normalized gaps
+double ladder_temperature(swap_slot *slots, const int nchains, const long storage, const double log_tmax)
 {
+  long p;
+  double gap, below = 0, total = 0;
+  for (p = 0; p < nchains - 1; ++p)
+  {
+    gap = exp(atomic_load(&slots[p].log_spacing));
+    if (p < storage)
+      below += gap;
+    total += gap;
+  }
+  return exp(log_tmax * below / total);
+}
 
-  long w, i;
+// Stochastic approximation step toward uniform swap acceptance, made by the chain answering an offer of pair
+void adapt_ladder(swap_slot *slots, const int nchains, const long pair, const long boundary, const double acceptance)
+{
+  long p, n = atomic_fetch_add(&slots[pair].nadapt, 1) + 1;
+  double rate = atomic_load(&slots[pair].rate), new_rate, mean_rate = 0, spacing, step;
+  if (n > LADDER_WINDOW)
+    n = LADDER_WINDOW;
+  // read-modify-writes as compare-exchange loops, so that no update of another chain is lost
+  do
+    new_rate = rate + (acceptance - rate) / n;
+  while (atomic_compare_exchange_weak(&slots[pair].rate, &rate, new_rate) == FALSE);
+
+  for (p = 0; p < nchains - 1; ++p)
+    mean_rate += atomic_load(&slots[p].rate);
+  mean_rate /= (nchains - 1);
+  // pairs that swap more often than the others get a wider gap
+  step = LADDER_GAIN * LADDER_LAG / (boundary + LADDER_LAG) * (new_rate - mean_rate);
+  spacing = atomic_load(&slots[pair].log_spacing);
+  while (atomic_compare_exchange_weak(&slots[pair].log_spacing, &spacing, spacing + step) == FALSE)
+    ;
+}
 
-  //  for(i=0;i<NREGULS;i++)
-  //  printf("CRi: %lf %lf\n", reg_param[i], reg_value[i]);
+#ifdef SQUEEZE_MPI
+// Concatenates the arrays of all ranks on rank 0, which gets a new array in place of its own. Other ranks keep theirs
+void *rank_gather(void *local, const size_t bytes)
+{
+  void *all = NULL;
+  if (mpi_rank == 0)
+    all = cache_aligned_calloc(mpi_size, bytes);
+  MPI_Gather(local, bytes, MPI_BYTE, all, bytes, MPI_BYTE, 0, MPI_COMM_WORLD);
+  if (mpi_rank != 0)
+    return local;
+  free(local);
+  return all;
+}
 
-  for (w = 0; w < nwavr; ++w)
+// Replica exchange with the chain holding the neighbouring temperature on rank peer, at the same boundary. Both chains send
+// (temperature, lPosterior), NAN when they are busy with an exchange within their rank, and the hotter one (higher rank) decides.
+// An accepted swap trades the states, which stay consistent without recomputation. Returns -1 if skipped, else 1 if accepted
+int rank_swap(const int peer, const long boundary, const bool available, RngStream rng, const double temperature, double *lLikelihood, double *lPrior,
+              double *chi2v2, double *chi2t3amp, double *chi2t3phi, double *chi2visamp, double *chi2visphi, unsigned short *element_x, unsigned short *element_y,
+              double *image, double complex *im_vis, double complex *mod_vis, double complex *param_vis, double *params, double *chi2_chan,
+              double *centroid_image_x, double *centroid_image_y, double *reg_value, double *fluxratio_image, int *trip_end, long *trip_start,
+              const long nelements, const int nwavr, const unsigned short axis_len)
+{
+  const int tag = (boundary / RANK_SWAP_INTERVAL) % RANK_TAG_RANGE;
+  double mine[2] = { temperature, (available == TRUE) ? *lLikelihood + *lPrior : NAN }, theirs[2];
+  int accepted = 0;
+  MPI_Sendrecv(mine, 2, MPI_DOUBLE, peer, tag, theirs, 2, MPI_DOUBLE, peer, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  if (isnan(mine[1]) || isnan(theirs[1]))
+    return -1;
+  if (peer < mpi_rank)
   {
-    if (reg_param[REG_DARKENERGY] > 0)
-      reg_value[w * NREGULS + REG_DARKENERGY] = den_full(&image[w * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, fluxscaling);
+    accepted = (log(RngStream_RandU01(rng)) < (1. / mine[0] - 1. / theirs[0]) * (mine[1] - theirs[1]));
+    MPI_Send(&accepted, 1, MPI_INT, peer, tag, MPI_COMM_WORLD);
+  }
+  else
+    MPI_Recv(&accepted, 1, MPI_INT, peer, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  if (accepted == 0)
+    return 0;
 
-    if (reg_param[REG_ENTROPY] > 0.0)
-      reg_value[w * NREGULS + REG_ENTROPY] = entropy_full(&image[w * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, fluxscaling);
+  double scalars[8] = { *lLikelihood, *lPrior, *chi2v2, *chi2t3amp, *chi2t3phi, *chi2visamp, *chi2visphi, 0 };
+  long trip[2] = { *trip_end, *trip_start };
+  MPI_Sendrecv_replace(scalars, 8, MPI_DOUBLE, peer, tag, peer, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  MPI_Sendrecv_replace(trip, 2, MPI_LONG, peer, tag, peer, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  MPI_Sendrecv_replace(element_x, nwavr * nelements, MPI_UNSIGNED_SHORT, peer, tag, peer, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  MPI_Sendrecv_replace(element_y, nwavr * nelements, MPI_UNSIGNED_SHORT, peer, tag, peer, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  MPI_Sendrecv_replace(image, nwavr * axis_len * axis_len, MPI_DOUBLE, peer, tag, peer, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  MPI_Sendrecv_replace(im_vis, nuv, MPI_C_DOUBLE_COMPLEX, peer, tag, peer, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  MPI_Sendrecv_replace(mod_vis, nuv, MPI_C_DOUBLE_COMPLEX, peer, tag, peer, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  MPI_Sendrecv_replace(param_vis, nuv, MPI_C_DOUBLE_COMPLEX, peer, tag, peer, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  MPI_Sendrecv_replace(fluxratio_image, nuv, MPI_DOUBLE, peer, tag, peer, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  MPI_Sendrecv_replace(params, MAX_PARAMS, MPI_DOUBLE, peer, tag, peer, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  MPI_Sendrecv_replace(chi2_chan, (nwavr + 1) * NCHI2, MPI_DOUBLE, peer, tag, peer, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  MPI_Sendrecv_replace(reg_value, nwavr * NREGULS, MPI_DOUBLE, peer, tag, peer, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  MPI_Sendrecv_replace(centroid_image_x, nwavr, MPI_DOUBLE, peer, tag, peer, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  MPI_Sendrecv_replace(centroid_image_y, nwavr, MPI_DOUBLE, peer, tag, peer, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  *lLikelihood = scalars[0];
+  *lPrior = scalars[1];
+  *chi2v2 = scalars[2];
+  *chi2t3amp = scalars[3];
+  *chi2t3phi = scalars[4];
+  *chi2visamp = scalars[5];
+  *chi2visphi = scalars[6];
+  *trip_end = trip[0];
+  *trip_start = trip[1];
+  return 1;
+}
+#endif
 
-    if (reg_param[REG_SPOT] > 0.0)
-      reg_value[w * NREGULS + REG_SPOT] = UDreg(&image[w * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, fluxscaling);
+// calloc for arrays of cache line aligned structures: the block starts on a cache line and spans whole lines
+void *cache_aligned_calloc(const size_t count, const size_t size)
+{
+  const size_t bytes = (count * size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE; // aligned_alloc wants a multiple of the alignment
+  void *block = aligned_alloc(CACHE_LINE, bytes);
+  if (block != NULL)
+    memset(block, 0, bytes);
+  return block;
+}
 
-    if (reg_param[REG_TV] > 0.0)
-      reg_value[w * NREGULS + REG_TV] = TV(&image[w * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, fluxscaling);
+// Bytes taken in a scratch arena by a request of the given size
+size_t arena_slice(const size_t bytes)
+{
+  return (bytes + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+}
 
-    if (reg_param[REG_LAP] > 0.0)
-      reg_value[w * NREGULS + REG_LAP] = LAP(&image[w * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, fluxscaling);
+void arena_init(scratch_arena *arena, const size_t size)
+{
+  arena->size = arena_slice(size);
+  arena->base = aligned_alloc(CACHE_LINE, (arena->size > 0) ? arena->size : CACHE_LINE);
+  arena->used = 0;
+  arena->peak = 0;
+  arena->nheap = 0;
+}
 
-    if (reg_param[REG_EDGE] > 0.0)
-        reg_value[w * NREGULS + REG_EDGE] = EDGE(&image[w * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, fluxscaling);
+// Slice of the arena, or heap block if arena is NULL (callers outside the chains) or full
+void *arena_alloc(scratch_arena *arena, const size_t bytes)
+{
+  void *block;
+  if (arena == NULL)
+    return malloc(bytes);
+  if (arena->used + arena_slice(bytes) > arena->size)
+  {
+    arena->nheap++;
+    return malloc(bytes);
+  }
+  block = arena->base + arena->used;
+  arena->used += arena_slice(bytes);
+  if (arena->used > arena->peak)
+    arena->peak = arena->used;
+  return block;
+}
 
-    if (reg_param[REG_L0] > 0.0)
-      reg_value[w * NREGULS + REG_L0] = L0(&image[w * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, fluxscaling);
+// Gives back a block from arena_alloc, for a slice also all those handed out after it
+void arena_free(scratch_arena *arena, void *block)
+{
+  if ((arena != NULL) && ((char *) block >= arena->base) && ((char *) block < arena->base + arena->size))
+  {
+    if ((size_t) ((char *) block - arena->base) < arena->used)
+      arena->used = (char *) block - arena->base;
+  }
+  else
+    free(block);
+}
 
-    if (reg_param[REG_L0CDF53] > 0.0)
-      {
-	reg_value[w * NREGULS + REG_L0CDF53] = L0_CDF53(&image[w * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, fluxscaling);
-      }
+// One population annealing step from T_old to T_new, with dbeta = 1/T_new - 1/T_old. Draws the ancestor of each replica
+// by systematic resampling, keeping every replica drawn in its own chain. Returns the log of the mean weight, with the
+// effective population size and the variance of that log (to first order) in *ess and *log_weight_var
+double population_resample(const double *lLikelihood, const int nreplicas, const double dbeta, RngStream rng, int *ancestor, double *ess, double *log_weight_var,
+                           scratch_arena *arena)
+{
+  int r, k, n;
+  double shift = -dbeta * lLikelihood[0], sum = 0, sum2 = 0, cumulative = 0, mean, u;
+  double *weight = arena_alloc(arena, nreplicas * sizeof(double));
+  int *copies = arena_alloc(arena, nreplicas * sizeof(int));
+  memset(copies, 0, nreplicas * sizeof(int));
+  for (r = 1; r < nreplicas; ++r)
+    if (-dbeta * lLikelihood[r] > shift)
+      shift = -dbeta * lLikelihood[r];
+  for (r = 0; r < nreplicas; ++r)
+  {
+    weight[r] = exp(-dbeta * lLikelihood[r] - shift);
+    sum += weight[r];
+    sum2 += weight[r] * weight[r];
+  }
+  mean = sum / nreplicas;
+  *ess = sum * sum / sum2;
+  *log_weight_var = (nreplicas > 1) ? fmax(sum2 / nreplicas - mean * mean, 0) / (nreplicas - 1) / (mean * mean) : 0;
 
-    if (reg_param[REG_L0CDF97] > 0.0)
-      {
-	reg_value[w * NREGULS + REG_L0CDF97] = L0_CDF97(&image[w * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, fluxscaling);
-      }
+  // nreplicas evenly spaced points with a single random offset, each one draws the replica whose cumulative weight it falls in
+  u = RngStream_RandU01(rng) * mean;
+  for (r = 0, k = 0; r < nreplicas; ++r)
+  {
+    cumulative += weight[r];
+    while ((k < nreplicas) && (u + k * mean < cumulative))
+    {
+      copies[r]++;
+      k++;
+    }
+  }
+  copies[nreplicas - 1] += nreplicas - k; // rounding of the last points
 
-    if (reg_param[REG_L0ATROUS] > 0.0)
+  // replicas drawn stay in their chain, their extra copies go to the chains of the replicas not drawn
+  for (r = 0; r < nreplicas; ++r)
+    ancestor[r] = (copies[r] > 0) ? r : -1;
+  for (r = 0, n = 0; r < nreplicas; ++r)
+    for (k = 1; k < copies[r]; ++k)
+    {
+      while (ancestor[n] != -1)
+        n++;
+      ancestor[n] = r;
+    }
+  arena_free(arena, copies);
+  arena_free(arena, weight);
+  return shift + log(mean);
+}
+
+// Copies the state of a replica into the chain of another, which stays consistent without recomputation
+void clone_replica(const population_replica *from, const population_replica *to, const long nelements, const int nwavr, const unsigned short axis_len)
+{
+  *to->lLikelihood = *from->lLikelihood;
+  *to->lPrior = *from->lPrior;
+  *to->chi2v2 = *from->chi2v2;
+  *to->chi2t3amp = *from->chi2t3amp;
+  *to->chi2t3phi = *from->chi2t3phi;
+  *to->chi2visamp = *from->chi2visamp;
+  *to->chi2visphi = *from->chi2visphi;
+  memcpy(to->element_x, from->element_x, nwavr * nelements * sizeof(unsigned short));
+  memcpy(to->element_y, from->element_y, nwavr * nelements * sizeof(unsigned short));
+  memcpy(to->image, from->image, nwavr * axis_len * axis_len * sizeof(double));
+  memcpy(to->im_vis, from->im_vis, nuv * sizeof(double complex));
+  memcpy(to->mod_vis, from->mod_vis, nuv * sizeof(double complex));
+  memcpy(to->param_vis, from->param_vis, nuv * sizeof(double complex));
+  memcpy(to->fluxratio_image, from->fluxratio_image, nuv * sizeof(double));
+  memcpy(to->params, from->params, MAX_PARAMS * sizeof(double));
+  memcpy(to->chi2_chan, from->chi2_chan, (nwavr + 1) * NCHI2 * sizeof(double));
+  memcpy(to->reg_value, from->reg_value, nwavr * NREGULS * sizeof(double));
+  memcpy(to->centroid_image_x, from->centroid_image_x, nwavr * sizeof(double));
+  memcpy(to->centroid_image_y, from->centroid_image_y, nwavr * sizeof(double));
+}
+
+// Nodes listed by Linux sysfs, cpu lists such as "0-15,32-47", restricted to the cpus the process may run on.
+// Without them, all online cpus form a single node
+void read_numa_topology(numa_topology *topo)
+{
+  char filename[80];
+  int node, first, last, c, ncpus = 0;
+  long ncpu_max = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+  ncpu_max = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  topo->nnodes = 0;
+  topo->node_start = malloc((NUMA_MAX_NODES + 1) * sizeof(int));
+  topo->cpus = NULL;
+  topo->node_start[0] = 0;
+#ifdef __linux__
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) != 0)
+  {
+    CPU_ZERO(&allowed);
+    for (c = 0; c < ncpu_max; ++c)
+      CPU_SET(c, &allowed);
+  }
+#endif
+  for (node = 0; node < NUMA_MAX_NODES; ++node)
+  {
+    sprintf(filename, "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *f = fopen(filename, "r");
+    if (f == NULL)
+      continue; // node numbers may have holes
+    while (fscanf(f, "%d", &first) == 1)
+    {
+      last = first;
+      if (fscanf(f, "-%d", &last) != 1)
+        last = first;
+      for (c = first; c <= last; ++c)
       {
-	reg_value[w * NREGULS + REG_L0ATROUS] = L0_ATROUS(&image[w * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, fluxscaling);
-      // DEBUG : this is a good place to test wavelet transforms
-    const int nscales = 4;
-    char wav_filename[100];
-    sprintf(wav_filename, "output.wav");
-     FILE *pFile = fopen(wav_filename, "w");
-
-
-    //     double* wav = malloc( nscales * axis_len * axis_len * sizeof(double));
-//     atrous_fwd(&image[0], wav, axis_len, axis_len, nscales);
-//     for(int k=0;k<4;k++)
-//     {
-//    	for(int j=0;j<axis_len;j++)
-//    	  {
-//    	    for(int i=0;i< axis_len;i++)
-//    	      fprintf(pFile, "%lf ", wav[k * axis_len * axis_len + j*axis_len +i]);
-//    	  }
-//      }
-//
-//      free(wav);
+#ifdef __linux__
+        if (!CPU_ISSET(c, &allowed))
+          continue;
+#endif
+        topo->cpus = realloc(topo->cpus, (ncpus + 1) * sizeof(int));
+        topo->cpus[ncpus++] = c;
+      }
+      if (fgetc(f) != ',')
+        break;
+    }
+    fclose(f);
+    if (ncpus > topo->node_start[topo->nnodes]) // memory-only nodes have no cpus to pin
+      topo->node_start[++topo->nnodes] = ncpus;
+  }
+  if (topo->nnodes == 0)
+  {
+    topo->cpus = realloc(topo->cpus, ncpu_max * sizeof(int));
+    for (c = 0; c < ncpu_max; ++c)
+      topo->cpus[c] = c;
+    topo->nnodes = 1;
+    topo->node_start[1] = ncpu_max;
+  }
+}
+
+void free_numa_topology(numa_topology *topo)
+{
+  free(topo->node_start);
+  free(topo->cpus);
+  topo->node_start = NULL;
+  topo->cpus = NULL;
+}
+
+// Restricts the calling thread to the given cpus. FALSE where affinity is not supported
+bool pin_thread(const int *cpus, const int ncpus)
+{
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int c = 0; c < ncpus; ++c)
+    CPU_SET(cpus[c], &set);
+  return (sched_setaffinity(0, sizeof(cpu_set_t), &set) == 0) ? TRUE : FALSE;
+#else
+  return FALSE;
+#endif
+}
+
+#ifdef _OPENMP
+// Returns FALSE if the run queue cannot be set up, in which case nothing is left to free
+bool chain_gate_init(chain_gate *gate, const int nchains, const int nthreads)
+{
+  int c;
+  gate->free_threads = nthreads;
+  gate->nchains = nchains;
+  gate->head = 0;
+  gate->tail = 0;
+  gate->queue = malloc(nchains * sizeof(int));
+  gate->wake = malloc(nchains * sizeof(pthread_cond_t));
+  gate->granted = calloc(nchains, sizeof(bool));
+  if ((gate->queue == NULL) || (gate->wake == NULL) || (gate->granted == NULL) || (pthread_mutex_init(&gate->lock, NULL) != 0))
+  {
+    free(gate->queue);
+    free(gate->wake);
+    free(gate->granted);
+    return FALSE;
+  }
+  for (c = 0; c < nchains; ++c)
+    if (pthread_cond_init(&gate->wake[c], NULL) != 0)
+    {
+      while (--c >= 0)
+        pthread_cond_destroy(&gate->wake[c]);
+      pthread_mutex_destroy(&gate->lock);
+      free(gate->queue);
+      free(gate->wake);
+      free(gate->granted);
+      return FALSE;
+    }
+  return TRUE;
+}
 
-  //    double **wav = malloc(sizeof(double *) * nscales);
-    // for (int k = 0; k < nscales; k++)
-    //  wav[k] = malloc(sizeof(double) * axis_len*axis_len);
+// Sleeps until a thread is handed to the chain. Called with the lock held
+static void chain_gate_sleep(chain_gate *gate, const int iChain)
+{
+  while (gate->granted[iChain] == FALSE) // also covers spurious wakeups
+    pthread_cond_wait(&gate->wake[iChain], &gate->lock);
+  gate->granted[iChain] = FALSE;
+}
 
+// Hands the thread to the chain waiting the longest. Called with the lock held and a non-empty queue
+static void chain_gate_hand(chain_gate *gate)
+{
+  const int next = gate->queue[gate->head++ % gate->nchains];
+  gate->granted[next] = TRUE;
+  pthread_cond_signal(&gate->wake[next]);
+}
 
-  //   for (i = 0; i < axis_len*axis_len; i++)
-  //    wav[0][i] = image[i]/fluxscaling;
+// Takes a free thread, or queues the chain until a thread is handed to it
+void chain_gate_enter(chain_gate *gate, const int iChain)
+{
+  pthread_mutex_lock(&gate->lock);
+  if ((gate->free_threads > 0) && (gate->head == gate->tail))
+    gate->free_threads--;
+  else
+  {
+    gate->queue[gate->tail++ % gate->nchains] = iChain;
+    chain_gate_sleep(gate, iChain);
+  }
+  pthread_mutex_unlock(&gate->lock);
+}
 
+// Hands the thread to the chain waiting the longest, if any, and queues behind the others
+void chain_gate_yield(chain_gate *gate, const int iChain)
+{
+  pthread_mutex_lock(&gate->lock);
+  if (gate->head != gate->tail)
+  {
+    chain_gate_hand(gate);
+    gate->queue[gate->tail++ % gate->nchains] = iChain;
+    chain_gate_sleep(gate, iChain);
+  }
+  pthread_mutex_unlock(&gate->lock);
+}
 
-  //   if (a_trous(wav, axis_len, axis_len, nscales, 1) != 0)
-  //    printf("Error during DWT \n");
+// A finished chain hands its thread to the next waiting chain, or frees it
+void chain_gate_leave(chain_gate *gate)
+{
+  pthread_mutex_lock(&gate->lock);
+  if (gate->head == gate->tail)
+    gate->free_threads++;
+  else
+    chain_gate_hand(gate);
+  pthread_mutex_unlock(&gate->lock);
+}
 
+void chain_gate_free(chain_gate *gate)
+{
+  for (int c = 0; c < gate->nchains; ++c)
+    pthread_cond_destroy(&gate->wake[c]);
+  pthread_mutex_destroy(&gate->lock);
+  free(gate->granted);
+  free(gate->wake);
+  free(gate->queue);
+}
+#endif
 
-    // for (int k = 0; k < nscales; k++)
-  //   for (int i = 0; i < axis_len*axis_len; i++)
-  //   	fprintf(pFile, "%lf ", wav[k][i]);
+// Adds one saved likelihood to the running moments of a storage. Two chains may briefly share a storage while a swap
+// takes effect, hence the critical section
+void accumulate_lLikelihood(lLikelihood_accumulator *acc, const double lLikelihood)
+{
+  #pragma omp critical(lLikelihood_moments)
+  {
+    acc->count++;
+    const double delta = lLikelihood - acc->mean;
+    acc->mean += delta / acc->count;
+    acc->m2 += delta * (lLikelihood - acc->mean);
+  }
+}
+
+// Mean and unbiased variance of the likelihoods accumulated so far
+void lLikelihood_moments(const lLikelihood_accumulator *acc, double *expectation, double *deviation)
+{
+  *expectation = acc->mean;
+  *deviation = (acc->count > 1) ? acc->m2 / (acc->count - 1) : 0;
+}
+
+// logZ from the accumulators of every storage. Moments are stored per chain, like temperature, as compute_logZ expects
+void storage_logZ(const lLikelihood_accumulator *accumulators, const double *temperature, const unsigned short *iStoragetoChain, const int nchains,
+                  double *lLikelihood_expectation, double *lLikelihood_deviation, double *logZ, double *logZ_err)
+{
+  long s;
+  #pragma omp critical(lLikelihood_moments)
+  for (s = 0; s < nchains; ++s)
+    lLikelihood_moments(&accumulators[s], &lLikelihood_expectation[iStoragetoChain[s]], &lLikelihood_deviation[iStoragetoChain[s]]);
+  compute_logZ(temperature, iStoragetoChain, lLikelihood_expectation, lLikelihood_deviation, nchains, logZ, logZ_err);
+}
+
+inline void swapi(unsigned short *a, unsigned short *b)
+{
+  unsigned short tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+inline void swapd(double *a, double *b)
+{
+  double tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
 
-    //  fclose(pFile);
-    //  printf("Debug: atrous %f\n", fluxscaling);
-    //  getchar();
+double sinc(double x)
+{
+  return sin(x + 1e-15) / (x + 1e-15);
+}
+
+void intHandler(int signum)
+{
+  printf("\nExiting at next opportunity\n");
+  if (ctrlcpressed == TRUE)
+    exit(0);
+  else
+    ctrlcpressed = TRUE;
+
+}
+
+/**********************************************************************/
+/* Draw a non-zero (xstep, ystep) for element current_elt of channel  */
+/* chan, following the current step type. Consumes digits of *rlong  */
+/* and draws new random numbers when needed.                          */
+/**********************************************************************/
+void draw_element_step(RngStream rng, long *rlong, const long steptype, const unsigned short *element_x, const unsigned short *element_y, const long chan,
+                       const long current_elt, const long nelements, const unsigned short axis_len, long *xstep, long *ystep)
+{
+  bool zerostep = TRUE;
+  long step = steptype, ntries = 0;
+  // select step
+  while(zerostep == TRUE)
+  {
+    // all the elements of the channel may sit on the same pixel, copying one of them then never moves anything
+    if ((step == STEP_COPYCAT) && (++ntries > 16 * nelements))
+      step = STEP_SMALL;
+    switch (step)
+    {
+      case STEP_SMALL: /* One step in either x or y direction */
+        *xstep = *rlong % 4;
+        *rlong /= 4;
+        if (*xstep > 1)      // 2 or 3, we select a y move
+        {
+          *ystep = (*xstep - 2) * 2 - 1;
+          *xstep = 0;
+        }
+        else       // 0 or 1, we select a x movement
+        {
+          *ystep = 0;
+          *xstep = *xstep * 2 - 1;
+        }
+        break;
+      case STEP_MEDIUM: /* Up to 2 steps in x and y direction */
+        *xstep = (*rlong % 5) - 2;
+        *rlong /= 5;
+        *ystep = (*rlong % 5) - 2;
+        *rlong /= 5;
+        break;
+      case STEP_ANYWHERE: /* Move flux anywhere in image */
+        *xstep = (RngStream_RandInt(rng, 0, 2147483647) % axis_len) - axis_len / 2;
+        *ystep = (RngStream_RandInt(rng, 0, 2147483647) % axis_len) - axis_len / 2;
+        break;
+      case STEP_COPYCAT: /* Copy the position of another element */
+        *xstep = element_x[chan * nelements + *rlong % nelements] - element_x[chan * nelements + current_elt];
+        *ystep = element_y[chan * nelements + *rlong % nelements] - element_y[chan * nelements + current_elt];
+        *rlong = RngStream_RandInt(rng, 0, 2147483647);
+        break;
+    }
+    if ((*xstep != 0) || (*ystep != 0))
+      zerostep = FALSE;
+    else // old position == new position --> we want to redraw
+      *rlong = RngStream_RandInt(rng, 0, 2147483647);
+  }
+}
+
+/**********************************************************************/
+/* Regularizer values after moving one element of channel chan from   */
+/* (old_x, old_y) to (new_x, new_y). The image is left unchanged, but */
+/* the centroid of the channel is moved (see cent_change)             */
+/**********************************************************************/
+void element_move_regularizers(const double *reg_param, const double *reg_value, double *new_reg_value, double *image, const double *prior_image,
+                               const edge_stats *edge_stat, cdf_state *cdf, atrous_state *atrous, double *centroid_image_x, double *centroid_image_y, const long chan, const unsigned short old_x, const unsigned short old_y,
+                               const unsigned short new_x, const unsigned short new_y, const unsigned short axis_len, const int nwavr, const long nelements,
+                               const double fov, const double cent_mult)
+{
+  const long old_pos = chan * axis_len * axis_len + old_y * axis_len + old_x;
+  const long new_pos = chan * axis_len * axis_len + new_y * axis_len + new_x;
+
+  // Regularizations for which we know the finite difference
+  if (reg_param[REG_ENTROPY] > 0.0)
+    new_reg_value[chan * NREGULS + REG_ENTROPY] = reg_value[chan * NREGULS + REG_ENTROPY]
+      - entropy(image[old_pos]) + entropy(image[old_pos] - 1)+ entropy(image[new_pos] + 1) - entropy(image[new_pos]);
+  if (reg_param[REG_PRIORIMAGE] > 0.0)
+    new_reg_value[chan * NREGULS + REG_PRIORIMAGE] = reg_value[chan * NREGULS + REG_PRIORIMAGE]
+      - prior_image[old_pos] + prior_image[new_pos];
+  if (reg_param[REG_DARKENERGY] > 0.0)
+    new_reg_value[chan * NREGULS + REG_DARKENERGY] = reg_value[chan * NREGULS + REG_DARKENERGY]
+      - den_change(image, old_x, old_y, DEN_SUBTRACT, axis_len) + den_change(image, new_x, new_y, DEN_ADD, axis_len);
+
+  if (reg_param[REG_L0] > 0.0)
+  {
+    new_reg_value[chan * NREGULS + REG_L0] = reg_value[chan * NREGULS + REG_L0] + (double)((image[new_pos]<.5)?1.0:0.0)
+      - (double)(( (image[old_pos]>0.5)&&(image[old_pos]<1.5))?1.0:0.0);
+  }
+
+  if (reg_param[REG_TRANSPECL2] > 0.0)
+    new_reg_value[REG_TRANSPECL2] = reg_value[REG_TRANSPECL2]//transpec(nwavr, axis_len, image, (const double) nelements)
+      - transpec_diffpoint(old_y * axis_len + old_x, chan, 0.0, nwavr, axis_len*axis_len, image) - transpec_diffpoint(new_y * axis_len + new_x, chan, 0.0, nwavr, axis_len*axis_len, image)    // remove old contribution
+      + transpec_diffpoint(old_y * axis_len + old_x, chan , -1.0, nwavr, axis_len*axis_len, image) + transpec_diffpoint(new_y * axis_len + new_x, chan , 1.0, nwavr, axis_len*axis_len, image);
+
+  if ((reg_param[REG_SPOT] > 0.0) || (reg_param[REG_TV] > 0.0))
+  {
+    // The move changes the gradients at the two pixels and their right and lower neighbours only.
+    // UDreg squares its sum, which is recovered from the current value (the sum is never negative)
+    double dL1g, dL05g;
+    gradient_sums_change(&image[chan * axis_len * axis_len], axis_len, axis_len, old_x, old_y, new_x, new_y, 0.0, &dL1g, &dL05g);
+    if (reg_param[REG_SPOT] > 0.0)
+    {
+      const double L05g = sqrt(reg_value[chan * NREGULS + REG_SPOT] * nelements) + dL05g;
+      new_reg_value[chan * NREGULS + REG_SPOT] = L05g * L05g / nelements;
     }
+    if (reg_param[REG_TV] > 0.0)
+      new_reg_value[chan * NREGULS + REG_TV] = reg_value[chan * NREGULS + REG_TV] + dL1g / nelements;
+  }
+
+  if (reg_param[REG_LAP] > 0.0)
+    new_reg_value[chan * NREGULS + REG_LAP] = reg_value[chan * NREGULS + REG_LAP]
+      + LAP_change(&image[chan * axis_len * axis_len], axis_len, axis_len, old_x, old_y, new_x, new_y, (const double) nelements);
+
+  if (reg_param[REG_EDGE] > 0.0)
+    new_reg_value[chan * NREGULS + REG_EDGE] = reg_value[chan * NREGULS + REG_EDGE]
+      + EDGE_change(&image[chan * axis_len * axis_len], &edge_stat[chan], axis_len, axis_len, old_x, old_y, new_x, new_y, 0.0, (const double) nelements);
+
+  // Wavelet transforms kept by the chain, updated on the moved image
+  image[old_pos]--;
+  image[new_pos]++;
+
+  // The CDF transforms relift the coefficients within the lifting support of the two pixels, then go back to the current image
+  for (int c = 0; c < NCDF; ++c)
+    if (cdf[chan * NCDF + c].coef != NULL)
+    {
+      double dL0, dL1;
+      cdf_state_move(&cdf[chan * NCDF + c], &image[chan * axis_len * axis_len], old_x, old_y, new_x, new_y, &dL0, &dL1);
+      cdf_state_undo(&cdf[chan * NCDF + c]);
+      if (reg_param[cdf_regs[c][0]] > 0.0)
+        new_reg_value[chan * NREGULS + cdf_regs[c][0]] = reg_value[chan * NREGULS + cdf_regs[c][0]] + dL0;
+      if (reg_param[cdf_regs[c][1]] > 0.0)
+        new_reg_value[chan * NREGULS + cdf_regs[c][1]] = reg_value[chan * NREGULS + cdf_regs[c][1]] + dL1;
+    }
+
+  // Same for the a trous transform, over the dilated footprints of the two pixels at each scale
+  if (atrous[chan].wav != NULL)
+  {
+    double dL0, dL1;
+    atrous_state_move(&atrous[chan], &image[chan * axis_len * axis_len], old_x, old_y, new_x, new_y, &dL0, &dL1);
+    atrous_state_undo(&atrous[chan]);
+    if (reg_param[REG_L0ATROUS] > 0.0)
+      new_reg_value[chan * NREGULS + REG_L0ATROUS] = reg_value[chan * NREGULS + REG_L0ATROUS] + dL0;
+    if (reg_param[REG_L1ATROUS] > 0.0)
+      new_reg_value[chan * NREGULS + REG_L1ATROUS] = reg_value[chan * NREGULS + REG_L1ATROUS] + dL1;
+  }
+
+
+  //printf("%lf ", fabs(new_reg_value[REG_TRANSPECL2]-transpec(nwavr, axis_len, image, (const double) nelements)));
+  //       if (reg_param[REG_TRANSPECL2] > 0.0)
+  //  new_reg_value[REG_TRANSPECL2] = transpec(nwavr, axis_len, image, (const double) nelements);
+
+  // Go back to current state
+  image[old_pos]++;
+  image[new_pos]--;
+
+  if (reg_param[REG_CENTERING] > 0.0)
+  {
+    //if((reg_param[REG_TRANSPECL2] > 0.0) && chan > 0
+    new_reg_value[chan * NREGULS + REG_CENTERING] = reg_value[chan * NREGULS + REG_CENTERING]
+        + fov * cent_change(chan, centroid_image_x, centroid_image_y, new_x, new_y, old_x, old_y, axis_len, fov, cent_mult);
+  }
+
+  if (reg_param[REG_MODELPARAM] > 0.0)
+    new_reg_value[REG_MODELPARAM] = reg_value[REG_MODELPARAM];
+}
+
+void compute_regularizers(const double *reg_param, double *reg_value, const double *image, const double *prior_image, const double fluxscaling,
+                          const unsigned short *initial_x, const unsigned short *initial_y, const int nwavr, const unsigned short axis_len, const long nelements,
+                          double *centroid_image_x, double *centroid_image_y, const double fov, const double cent_mult, scratch_arena *arena)
+{
+
+  long w, i;
+
+  //  for(i=0;i<NREGULS;i++)
+  //  printf("CRi: %lf %lf\n", reg_param[i], reg_value[i]);
+
+  for (w = 0; w < nwavr; ++w)
+  {
+    if (reg_param[REG_DARKENERGY] > 0)
+      reg_value[w * NREGULS + REG_DARKENERGY] = den_full(&image[w * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, fluxscaling);
+
+    if (reg_param[REG_ENTROPY] > 0.0)
+      reg_value[w * NREGULS + REG_ENTROPY] = entropy_full(&image[w * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, fluxscaling);
+
+    if (reg_param[REG_SPOT] > 0.0)
+      reg_value[w * NREGULS + REG_SPOT] = UDreg(&image[w * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, fluxscaling);
+
+    if (reg_param[REG_TV] > 0.0)
+      reg_value[w * NREGULS + REG_TV] = TV(&image[w * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, fluxscaling);
+
+    if (reg_param[REG_LAP] > 0.0)
+      reg_value[w * NREGULS + REG_LAP] = LAP(&image[w * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, fluxscaling);
+
+    if (reg_param[REG_EDGE] > 0.0)
+        reg_value[w * NREGULS + REG_EDGE] = EDGE(&image[w * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, fluxscaling);
+
+    if (reg_param[REG_L0] > 0.0)
+      reg_value[w * NREGULS + REG_L0] = L0(&image[w * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, fluxscaling);
+
+    if (reg_param[REG_L0CDF53] > 0.0)
+      {
+	reg_value[w * NREGULS + REG_L0CDF53] = L0_CDF53(&image[w * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, fluxscaling, arena);
+      }
+
+    if (reg_param[REG_L0CDF97] > 0.0)
+      {
+	reg_value[w * NREGULS + REG_L0CDF97] = L0_CDF97(&image[w * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, fluxscaling, arena);
+      }
+
+    if (reg_param[REG_L0ATROUS] > 0.0)
+      {
+	reg_value[w * NREGULS + REG_L0ATROUS] = L0_ATROUS(&image[w * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, fluxscaling, arena);
+      }
 
     if (reg_param[REG_L1CDF53] > 0.0)
       {
-	reg_value[w * NREGULS + REG_L1CDF53] = L1_CDF53(&image[w * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, fluxscaling);
+	reg_value[w * NREGULS + REG_L1CDF53] = L1_CDF53(&image[w * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, fluxscaling, arena);
       }
 
     if (reg_param[REG_L1CDF97] > 0.0)
       {
-	reg_value[w * NREGULS + REG_L1CDF97] = L1_CDF97(&image[w * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, fluxscaling);
+	reg_value[w * NREGULS + REG_L1CDF97] = L1_CDF97(&image[w * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, fluxscaling, arena);
 }
 
     if (reg_param[REG_L1ATROUS] > 0.0)
       {
-	reg_value[w * NREGULS + REG_L1ATROUS] = L1_ATROUS(&image[w * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, fluxscaling);
+	reg_value[w * NREGULS + REG_L1ATROUS] = L1_ATROUS(&image[w * axis_len * axis_len], NULL, 0.0, axis_len, axis_len, fluxscaling, arena);
 
 
       }
@@ -2837,9 +4530,352 @@ void compute_regularizers(const double *reg_param, double *reg_value, const doub
 
 }
 
+/**********************************************************************/
+/* Visibility update of an element move from (old_x, old_y) to        */
+/* (new_x, new_y), restricted to the uv points [uv_start, uv_end):    */
+/* new_im_vis = im_vis + (X[new]*Y[new] - X[old]*Y[old]) * fluxratio / nelements */
+/* Vectorized on the split real/imaginary phasor rows, with a scalar  */
+/* loop for the remainder and for builds without AVX2                 */
+/* fluxratio / nelements scales the real and imaginary parts apart,   */
+/* which does not round like the former complex expression: the       */
+/* visibilities agree with it to rounding, not bit for bit (-resync   */
+/* bounds the drift)                                                  */
+/**********************************************************************/
+#if defined(__AVX512F__)
+// Adds the 8 deltas (dre, dim) at uv point j to the interleaved im_vis and param_vis
+static inline void store_vis_update8(const long j, __m512d dre, __m512d dim, const double *im, const double *par, double *new_im, double *new_mod)
+{
+  const __m512i lo_idx = _mm512_set_epi64(11, 10, 3, 2, 9, 8, 1, 0);
+  const __m512i hi_idx = _mm512_set_epi64(15, 14, 7, 6, 13, 12, 5, 4);
+  // (re0 im0 re2 im2 ...) and (re1 im1 re3 im3 ...) -> interleaved complex order
+  __m512d ulo = _mm512_unpacklo_pd(dre, dim), uhi = _mm512_unpackhi_pd(dre, dim);
+  __m512d v0 = _mm512_add_pd(_mm512_loadu_pd(&im[2 * j]), _mm512_permutex2var_pd(ulo, lo_idx, uhi));
+  __m512d v1 = _mm512_add_pd(_mm512_loadu_pd(&im[2 * j + 8]), _mm512_permutex2var_pd(ulo, hi_idx, uhi));
+  _mm512_storeu_pd(&new_im[2 * j], v0);
+  _mm512_storeu_pd(&new_im[2 * j + 8], v1);
+  _mm512_storeu_pd(&new_mod[2 * j], _mm512_add_pd(v0, _mm512_loadu_pd(&par[2 * j])));
+  _mm512_storeu_pd(&new_mod[2 * j + 8], _mm512_add_pd(v1, _mm512_loadu_pd(&par[2 * j + 8])));
+}
+
+static inline void element_delta8(__m512d a, __m512d b, __m512d c, __m512d d, __m512d e, __m512d f, __m512d g, __m512d h, __m512d scale, __m512d *dre, __m512d *dim)
+{
+  *dre = _mm512_mul_pd(_mm512_sub_pd(_mm512_sub_pd(_mm512_mul_pd(a, c), _mm512_mul_pd(b, d)), _mm512_sub_pd(_mm512_mul_pd(e, g), _mm512_mul_pd(f, h))), scale);
+  *dim = _mm512_mul_pd(_mm512_sub_pd(_mm512_add_pd(_mm512_mul_pd(a, d), _mm512_mul_pd(b, c)), _mm512_add_pd(_mm512_mul_pd(e, h), _mm512_mul_pd(f, g))), scale);
+}
+#elif defined(__AVX2__)
+// Adds the 4 deltas (dre, dim) at uv point j to the interleaved im_vis and param_vis
+static inline void store_vis_update4(const long j, __m256d dre, __m256d dim, const double *im, const double *par, double *new_im, double *new_mod)
+{
+  // (re0 im0 re2 im2) and (re1 im1 re3 im3) -> interleaved complex order
+  __m256d ulo = _mm256_unpacklo_pd(dre, dim), uhi = _mm256_unpackhi_pd(dre, dim);
+  __m256d v0 = _mm256_add_pd(_mm256_loadu_pd(&im[2 * j]), _mm256_permute2f128_pd(ulo, uhi, 0x20));
+  __m256d v1 = _mm256_add_pd(_mm256_loadu_pd(&im[2 * j + 4]), _mm256_permute2f128_pd(ulo, uhi, 0x31));
+  _mm256_storeu_pd(&new_im[2 * j], v0);
+  _mm256_storeu_pd(&new_im[2 * j + 4], v1);
+  _mm256_storeu_pd(&new_mod[2 * j], _mm256_add_pd(v0, _mm256_loadu_pd(&par[2 * j])));
+  _mm256_storeu_pd(&new_mod[2 * j + 4], _mm256_add_pd(v1, _mm256_loadu_pd(&par[2 * j + 4])));
+}
+
+static inline void element_delta4(__m256d a, __m256d b, __m256d c, __m256d d, __m256d e, __m256d f, __m256d g, __m256d h, __m256d scale, __m256d *dre, __m256d *dim)
+{
+  *dre = _mm256_mul_pd(_mm256_sub_pd(_mm256_sub_pd(_mm256_mul_pd(a, c), _mm256_mul_pd(b, d)), _mm256_sub_pd(_mm256_mul_pd(e, g), _mm256_mul_pd(f, h))), scale);
+  *dim = _mm256_mul_pd(_mm256_sub_pd(_mm256_add_pd(_mm256_mul_pd(a, d), _mm256_mul_pd(b, c)), _mm256_add_pd(_mm256_mul_pd(e, h), _mm256_mul_pd(f, g))), scale);
+}
+#endif
+
+void update_vis_element_move(double complex *__restrict new_im_vis, double complex *__restrict new_mod_vis, const double complex *__restrict im_vis,
+                             const double complex *__restrict param_vis, const double *__restrict fluxratio_image,
+                             const double *__restrict xtransform, const double *__restrict ytransform,
+                             const long new_x, const long new_y, const long old_x, const long old_y, const long uv_start, const long uv_end, const double nelements)
+{
+  long j = uv_start;
+  const double *xnew_re = &PHASOR_RE(xtransform, new_x, 0), *xnew_im = &PHASOR_IM(xtransform, new_x, 0);
+  const double *ynew_re = &PHASOR_RE(ytransform, new_y, 0), *ynew_im = &PHASOR_IM(ytransform, new_y, 0);
+  const double *xold_re = &PHASOR_RE(xtransform, old_x, 0), *xold_im = &PHASOR_IM(xtransform, old_x, 0);
+  const double *yold_re = &PHASOR_RE(ytransform, old_y, 0), *yold_im = &PHASOR_IM(ytransform, old_y, 0);
+
+#if defined(__AVX512F__)
+  __m512d dre, dim;
+  const __m512d vnelements = _mm512_set1_pd(nelements);
+  for (; j + 8 <= uv_end; j += 8)
+  {
+    element_delta8(_mm512_loadu_pd(&xnew_re[j]), _mm512_loadu_pd(&xnew_im[j]), _mm512_loadu_pd(&ynew_re[j]), _mm512_loadu_pd(&ynew_im[j]),
+                   _mm512_loadu_pd(&xold_re[j]), _mm512_loadu_pd(&xold_im[j]), _mm512_loadu_pd(&yold_re[j]), _mm512_loadu_pd(&yold_im[j]),
+                   _mm512_div_pd(_mm512_loadu_pd(&fluxratio_image[j]), vnelements), &dre, &dim);
+    store_vis_update8(j, dre, dim, (const double *) im_vis, (const double *) param_vis, (double *) new_im_vis, (double *) new_mod_vis);
+  }
+#elif defined(__AVX2__)
+  __m256d dre, dim;
+  const __m256d vnelements = _mm256_set1_pd(nelements);
+  for (; j + 4 <= uv_end; j += 4)
+  {
+    element_delta4(_mm256_loadu_pd(&xnew_re[j]), _mm256_loadu_pd(&xnew_im[j]), _mm256_loadu_pd(&ynew_re[j]), _mm256_loadu_pd(&ynew_im[j]),
+                   _mm256_loadu_pd(&xold_re[j]), _mm256_loadu_pd(&xold_im[j]), _mm256_loadu_pd(&yold_re[j]), _mm256_loadu_pd(&yold_im[j]),
+                   _mm256_div_pd(_mm256_loadu_pd(&fluxratio_image[j]), vnelements), &dre, &dim);
+    store_vis_update4(j, dre, dim, (const double *) im_vis, (const double *) param_vis, (double *) new_im_vis, (double *) new_mod_vis);
+  }
+#endif
+
+  double delta_re, delta_im, scale;
+  for (; j < uv_end; ++j)
+  {
+    scale = fluxratio_image[j] / nelements;
+    delta_re = (xnew_re[j] * ynew_re[j] - xnew_im[j] * ynew_im[j]) - (xold_re[j] * yold_re[j] - xold_im[j] * yold_im[j]);
+    delta_im = (xnew_re[j] * ynew_im[j] + xnew_im[j] * ynew_re[j]) - (xold_re[j] * yold_im[j] + xold_im[j] * yold_re[j]);
+    new_im_vis[j] = im_vis[j] + (delta_re * scale + I * delta_im * scale);
+    new_mod_vis[j] = new_im_vis[j] + param_vis[j];
+  }
+}
+
+// Same update from single-precision phasor tables, the visibilities are still accumulated in double
+void update_vis_element_move_float(double complex *__restrict new_im_vis, double complex *__restrict new_mod_vis, const double complex *__restrict im_vis,
+                                   const double complex *__restrict param_vis, const double *__restrict fluxratio_image,
+                                   const float *__restrict xtransform, const float *__restrict ytransform,
+                                   const long new_x, const long new_y, const long old_x, const long old_y, const long uv_start, const long uv_end, const double nelements)
+{
+  long j = uv_start;
+  const float *xnew_re = &PHASOR_RE(xtransform, new_x, 0), *xnew_im = &PHASOR_IM(xtransform, new_x, 0);
+  const float *ynew_re = &PHASOR_RE(ytransform, new_y, 0), *ynew_im = &PHASOR_IM(ytransform, new_y, 0);
+  const float *xold_re = &PHASOR_RE(xtransform, old_x, 0), *xold_im = &PHASOR_IM(xtransform, old_x, 0);
+  const float *yold_re = &PHASOR_RE(ytransform, old_y, 0), *yold_im = &PHASOR_IM(ytransform, old_y, 0);
+
+#if defined(__AVX512F__)
+  __m512d dre, dim;
+  const __m512d vnelements = _mm512_set1_pd(nelements);
+  for (; j + 8 <= uv_end; j += 8)
+  {
+    element_delta8(_mm512_cvtps_pd(_mm256_loadu_ps(&xnew_re[j])), _mm512_cvtps_pd(_mm256_loadu_ps(&xnew_im[j])),
+                   _mm512_cvtps_pd(_mm256_loadu_ps(&ynew_re[j])), _mm512_cvtps_pd(_mm256_loadu_ps(&ynew_im[j])),
+                   _mm512_cvtps_pd(_mm256_loadu_ps(&xold_re[j])), _mm512_cvtps_pd(_mm256_loadu_ps(&xold_im[j])),
+                   _mm512_cvtps_pd(_mm256_loadu_ps(&yold_re[j])), _mm512_cvtps_pd(_mm256_loadu_ps(&yold_im[j])),
+                   _mm512_div_pd(_mm512_loadu_pd(&fluxratio_image[j]), vnelements), &dre, &dim);
+    store_vis_update8(j, dre, dim, (const double *) im_vis, (const double *) param_vis, (double *) new_im_vis, (double *) new_mod_vis);
+  }
+#elif defined(__AVX2__)
+  __m256d dre, dim;
+  const __m256d vnelements = _mm256_set1_pd(nelements);
+  for (; j + 4 <= uv_end; j += 4)
+  {
+    element_delta4(_mm256_cvtps_pd(_mm_loadu_ps(&xnew_re[j])), _mm256_cvtps_pd(_mm_loadu_ps(&xnew_im[j])),
+                   _mm256_cvtps_pd(_mm_loadu_ps(&ynew_re[j])), _mm256_cvtps_pd(_mm_loadu_ps(&ynew_im[j])),
+                   _mm256_cvtps_pd(_mm_loadu_ps(&xold_re[j])), _mm256_cvtps_pd(_mm_loadu_ps(&xold_im[j])),
+                   _mm256_cvtps_pd(_mm_loadu_ps(&yold_re[j])), _mm256_cvtps_pd(_mm_loadu_ps(&yold_im[j])),
+                   _mm256_div_pd(_mm256_loadu_pd(&fluxratio_image[j]), vnelements), &dre, &dim);
+    store_vis_update4(j, dre, dim, (const double *) im_vis, (const double *) param_vis, (double *) new_im_vis, (double *) new_mod_vis);
+  }
+#endif
+
+  double delta_re, delta_im, scale;
+  for (; j < uv_end; ++j)
+  {
+    scale = fluxratio_image[j] / nelements;
+    delta_re = ((double) xnew_re[j] * ynew_re[j] - (double) xnew_im[j] * ynew_im[j]) - ((double) xold_re[j] * yold_re[j] - (double) xold_im[j] * yold_im[j]);
+    delta_im = ((double) xnew_re[j] * ynew_im[j] + (double) xnew_im[j] * ynew_re[j]) - ((double) xold_re[j] * yold_im[j] + (double) xold_im[j] * yold_re[j]);
+    new_im_vis[j] = im_vis[j] + (delta_re * scale + I * delta_im * scale);
+    new_mod_vis[j] = new_im_vis[j] + param_vis[j];
+  }
+}
+
+// Contiguous share of [uv_start, uv_end) of the calling thread in the current team
+void team_uv_range(const long uv_start, const long uv_end, long *sub_start, long *sub_end)
+{
+#ifdef _OPENMP
+  const long nteam = omp_get_num_threads(), rank = omp_get_thread_num();
+#else
+  const long nteam = 1, rank = 0;
+#endif
+  const long chunk = (uv_end - uv_start + nteam - 1) / nteam;
+  *sub_start = uv_start + rank * chunk;
+  *sub_end = *sub_start + chunk;
+  if (*sub_start > uv_end)
+    *sub_start = uv_end;
+  if (*sub_end > uv_end)
+    *sub_end = uv_end;
+}
+
+/**********************************************************************/
+/* Multiple-try Metropolis: model visibilities of ncand candidate     */
+/* positions of the moved element, in one pass over the uv range.     */
+/* Candidate k is stored at cand_vis[k * nuv + j]                     */
+/**********************************************************************/
+void update_vis_candidates(double complex *__restrict cand_vis, const double complex *__restrict im_vis, const double complex *__restrict param_vis,
+                           const double *__restrict fluxratio_image, const double *__restrict xtransform, const double *__restrict ytransform,
+                           const unsigned short *cand_x, const unsigned short *cand_y, const int ncand, const long old_x, const long old_y,
+                           const long uv_start, const long uv_end, const double nelements)
+{
+  long j;
+  int k;
+  double complex base, scale;
+  for (j = uv_start; j < uv_end; ++j)
+  {
+    scale = fluxratio_image[j] / nelements;
+    base = im_vis[j] + param_vis[j] - PHASOR(xtransform, old_x, j) * PHASOR(ytransform, old_y, j) * scale;
+    for (k = 0; k < ncand; ++k)
+      cand_vis[k * nuv + j] = base + PHASOR(xtransform, cand_x[k], j) * PHASOR(ytransform, cand_y[k], j) * scale;
+  }
+}
+
+// Channel chi2 of ncand candidate visibility sets, in one pass over the observables of the channel
+void compute_chi2_chan_multi(double *chi2, const double complex *__restrict cand_vis, const int ncand, const long chan)
+{
+  long i, n;
+  int k;
+  double r;
+  double complex modt3;
+  const long t3ampoffset = nv2;
+  const long visampoffset = nv2 + nt3amp;
+  const long t3phioffset = nv2 + nt3amp + nvisamp;
+  const long visphioffset = nv2 + nt3amp + nvisamp + nt3phi;
+
+  for (k = 0; k < ncand; ++k)
+    chi2[k] = 0;
+
+  for (n = v2_chan_off[chan]; n < v2_chan_off[chan + 1]; ++n)
+  {
+    i = v2_chan_idx[n];
+    for (k = 0; k < ncand; ++k)
+    {
+      r = (modsq(cand_vis[k * nuv + v2in[i]]) - data[i]) * data_err[i];
+      chi2[k] += r * r;
+    }
+  }
+
+  for (n = t3_chan_off[chan]; n < t3_chan_off[chan + 1]; ++n)
+  {
+    i = t3_chan_idx[n];
+    for (k = 0; k < ncand; ++k)
+    {
+      modt3 = cand_vis[k * nuv + t3in1[i]] * cand_vis[k * nuv + t3in2[i]] * conj(cand_vis[k * nuv + t3in3[i]]);
+      if ((i < nt3amp) && (data_err[t3ampoffset + i] > 0))
+      {
+        r = (cabs(modt3) - data[t3ampoffset + i]) * data_err[t3ampoffset + i];
+        chi2[k] += r * r;
+      }
+      if ((i < nt3phi) && (data_err[t3phioffset + i] > 0))
+      {
+        r = dewrap(carg(modt3) - data[t3phioffset + i]) * data_err[t3phioffset + i];
+        chi2[k] += r * r;
+      }
+    }
+  }
+
+  for (n = visamp_chan_off[chan]; n < visamp_chan_off[chan + 1]; ++n)
+  {
+    i = visamp_chan_idx[n];
+    if (data_err[visampoffset + i] > 0)
+      for (k = 0; k < ncand; ++k)
+      {
+        r = (cabs(cand_vis[k * nuv + visin[i]]) - data[visampoffset + i]) * data_err[visampoffset + i];
+        chi2[k] += r * r;
+      }
+  }
+
+  // channel-local likelihood implies non-differential phases
+  for (n = visphi_chan_off[chan]; n < visphi_chan_off[chan + 1]; ++n)
+  {
+    i = visphi_chan_idx[n];
+    if (data_err[visphioffset + i] > 0)
+      for (k = 0; k < ncand; ++k)
+      {
+        r = dewrap(carg(cand_vis[k * nuv + visin[i]]) - data[visphioffset + i]) * data_err[visphioffset + i];
+        chi2[k] += r * r;
+      }
+  }
+}
+
+// Log posterior weights, relative to the current state, of ncand candidate positions for the moved element
+void mtm_log_weights(double *log_weight, const unsigned short *cand_x, const unsigned short *cand_y, const int ncand, double complex *cand_vis, double *cand_reg_value,
+                     const double complex *im_vis, const double complex *param_vis, const double *fluxratio_image, const double *xtransform, const double *ytransform,
+                     const double *reg_param, const double *reg_value, double *image, const double *prior_image, const edge_stats *edge_stat, cdf_state *cdf, atrous_state *atrous,
+                     double *centroid_image_x, double *centroid_image_y, const long chan, const unsigned short old_x, const unsigned short old_y, const unsigned short axis_len, const int nwavr, const long nelements,
+                     const double fov, const double cent_mult, const double chi2_others, const double lLikelihood, const double lPrior, const double temperature)
+{
+  int k;
+  double chi2[MTM_MAX_TRIES], cand_lPrior;
+
+  update_vis_candidates(cand_vis, im_vis, param_vis, fluxratio_image, xtransform, ytransform, cand_x, cand_y, ncand, old_x, old_y,
+                        chan_uv_start[chan], chan_uv_start[chan + 1], (double) nelements);
+  compute_chi2_chan_multi(chi2, cand_vis, ncand, chan);
+
+  for (k = 0; k < ncand; ++k)
+  {
+    memcpy(cand_reg_value, reg_value, nwavr * NREGULS * sizeof(double));
+    element_move_regularizers(reg_param, reg_value, cand_reg_value, image, prior_image, edge_stat, cdf, atrous, centroid_image_x, centroid_image_y, chan, old_x, old_y,
+                              cand_x[k], cand_y[k], axis_len, nwavr, nelements, fov, cent_mult);
+    if (reg_param[REG_CENTERING] > 0.0) // undo the centroid move
+      cent_change(chan, centroid_image_x, centroid_image_y, old_x, old_y, cand_x[k], cand_y[k], axis_len, fov, cent_mult);
+    compute_lPrior_allwav(&cand_lPrior, nwavr, reg_param, cand_reg_value);
+    log_weight[k] = -((0.5 * (chi2_others + chi2[k]) - lLikelihood) / temperature + cand_lPrior - lPrior);
+  }
+}
+
+/**********************************************************************/
+/* On-the-fly phasors: for uv point j and pixel offset p from the     */
+/* image centre, the phasor is sinc(s p) exp(i theta p). Both         */
+/* exp(i theta) and exp(i s) are stored and raised to the integer    */
+/* power |p|, so no transcendental function is evaluated per move     */
+/**********************************************************************/
+void set_phasor_base(double *base, const long j, const double theta, const double s)
+{
+  base[j] = cos(theta);
+  base[nuv + j] = sin(theta);
+  base[2 * nuv + j] = cos(s);
+  base[3 * nuv + j] = sin(s);
+  base[4 * nuv + j] = s;
+}
+
+// (re + i im)^n for n >= 0, by binary exponentiation
+static inline void complex_ipow(double re, double im, long n, double *out_re, double *out_im)
+{
+  double res_re = 1., res_im = 0., temp;
+  while (n > 0)
+  {
+    if (n & 1)
+    {
+      temp = res_re * re - res_im * im;
+      res_im = res_re * im + res_im * re;
+      res_re = temp;
+    }
+    temp = re * re - im * im;
+    im = 2. * re * im;
+    re = temp;
+    n >>= 1;
+  }
+  *out_re = res_re;
+  *out_im = res_im;
+}
+
+double complex phasor_value(const double *base, const long p, const long j)
+{
+  double re, im, sinc_re, sinc_im, smear = 1.;
+  const long n = labs(p);
+  complex_ipow(base[j], base[nuv + j], n, &re, &im);
+  if (p < 0)
+    im = -im;
+  if ((n > 0) && (base[4 * nuv + j] != 0.))
+  {
+    complex_ipow(base[2 * nuv + j], base[3 * nuv + j], n, &sinc_re, &sinc_im);
+    smear = sinc_im / (base[4 * nuv + j] * n); // sin(s n) / (s n)
+  }
+  return smear * (re + I * im);
+}
+
+// Fills [uv_start, uv_end) of one split real/imaginary row (same layout as the phasor tables)
+void phasor_row(double *row, const double *base, const long p, const long uv_start, const long uv_end)
+{
+  long j;
+  double complex phasor;
+  for (j = uv_start; j < uv_end; ++j)
+  {
+    phasor = phasor_value(base, p, j);
+    row[j] = creal(phasor);
+    row[nuv + j] = cimag(phasor);
+  }
+}
+
 void compute_model_visibilities_fromelements(double complex *mod_vis, double complex *im_vis, double complex *param_vis,
     double *params, double *fluxratio_image, const unsigned short *element_x, const unsigned short *element_y,
-    const double complex *xtransform, const double complex *ytransform, double *lPriorModel, long nparams, long nelements)
+    const double *xtransform, const double *ytransform, double *lPriorModel, long nparams, long nelements, unsigned short axis_len)
 {
   long i, j;
   if (nparams > 0)
@@ -2849,18 +4885,25 @@ void compute_model_visibilities_fromelements(double complex *mod_vis, double com
       param_vis[j] = 0.0;
 
   // Compute visibilities from scratch
+  #pragma omp parallel for num_threads(chain_threads) private(i) schedule(static) if ((chain_threads > 1) && (nuv >= par_threshold))
   for (j = 0; j < nuv; ++j)
   {
     im_vis[j] = 0;
     for (i = 0; i < nelements; ++i)
-      im_vis[j] += xtransform[element_x[ uvwav2chan[j] * nelements + i] * nuv + j] * ytransform[element_y[ uvwav2chan[j] * nelements + i] * nuv + j];
+    {
+      if (xtransform != NULL)
+        im_vis[j] += PHASOR(xtransform, element_x[ uvwav2chan[j] * nelements + i], j) * PHASOR(ytransform, element_y[ uvwav2chan[j] * nelements + i], j);
+      else
+        im_vis[j] += phasor_value(xphasor_base, element_x[ uvwav2chan[j] * nelements + i] - axis_len / 2, j)
+                     * phasor_value(yphasor_base, element_y[ uvwav2chan[j] * nelements + i] - axis_len / 2, j);
+    }
     im_vis[j] *= fluxratio_image[j] / (double) nelements; // Will add SED here
     mod_vis[j] = param_vis[j] + im_vis[j];
   }
 }
 
 void compute_model_visibilities_fromimage(double complex *mod_vis, double complex *im_vis, double complex *param_vis,
-    const double *params, double *fluxratio_image, const double *image, const double complex *xtransform, const double complex *ytransform,
+    const double *params, double *fluxratio_image, const double *image, const double *xtransform, const double *ytransform,
     double *lPriorModel, long nparams, long nelements, unsigned short axis_len)
 {
   // Note: input image should be normalized
@@ -2873,13 +4916,35 @@ void compute_model_visibilities_fromimage(double complex *mod_vis, double comple
       param_vis[j] = 0.0;
 
   // Compute image visibilities
+  double complex *xcol = NULL, *ycol = NULL;
+  if (xtransform == NULL)
+  {
+    xcol = malloc(axis_len * sizeof(double complex));
+    ycol = malloc(axis_len * sizeof(double complex));
+  }
   for (j = 0; j < nuv; ++j)
   {
     im_vis[j] = 0;
-    for (ix = 0; ix < axis_len; ix++)
-      for (iy = 0; iy < axis_len; iy++)
-        im_vis[j] += image[uvwav2chan[j] * axis_len * axis_len + iy * axis_len + ix] * xtransform[ix * nuv + j] * ytransform[iy * nuv + j];
+    if (xtransform != NULL)
+    {
+      for (ix = 0; ix < axis_len; ix++)
+        for (iy = 0; iy < axis_len; iy++)
+          im_vis[j] += image[uvwav2chan[j] * axis_len * axis_len + iy * axis_len + ix] * PHASOR(xtransform, ix, j) * PHASOR(ytransform, iy, j);
+    }
+    else
+    {
+      for (ix = 0; ix < axis_len; ix++)
+      {
+        xcol[ix] = phasor_value(xphasor_base, ix - axis_len / 2, j);
+        ycol[ix] = phasor_value(yphasor_base, ix - axis_len / 2, j);
+      }
+      for (ix = 0; ix < axis_len; ix++)
+        for (iy = 0; iy < axis_len; iy++)
+          im_vis[j] += image[uvwav2chan[j] * axis_len * axis_len + iy * axis_len + ix] * xcol[ix] * ycol[iy];
+    }
   }
+  free(xcol);
+  free(ycol);
 
   for (j = 0; j < nuv; ++j)
   {
@@ -2920,7 +4985,7 @@ bool read_commandline(int *argc, char **argv, bool *benchmark, bool *use_v2, boo
                       double *visampa, double *visphis, double *visphia, double *fluxs, double *cvfwhm, double *reg_param, double *init_param, double **pwavmin,
                       double **pwavmax, int *nwavr, bool *wavauto)
 {
-  long i, j, k;
+  long i, j, k, dummy_long;
   double *wavmin, *wavmax;
   /* Read in command line info... */
   if (*argc < 2) // need at least a filename to do something
@@ -3015,11 +5080,36 @@ bool read_commandline(int *argc, char **argv, bool *benchmark, bool *use_v2, boo
     {
       *use_bandwidthsmearing = FALSE; // disable bandwidth smearing
     }
+    else if (strcmp(argv[i], "-noearlyreject") == 0)
+    {
+      use_early_rejection = FALSE; // disable the bounded chi2 evaluation
+    }
+    else if (strcmp(argv[i], "-adaptladder") == 0)
+    {
+      use_adaptive_ladder = TRUE; // tune the parallel tempering ladder during burn-in
+    }
+    else if (strcmp(argv[i], "-deo") == 0)
+    {
+      use_deo_swaps = TRUE; // non-reversible even/odd swap schedule
+    }
+    else if (strcmp(argv[i], "-numa") == 0)
+    {
+      use_numa = TRUE; // per-node phasor tables and chain pinning
+    }
+    else if (strcmp(argv[i], "-steppingstone") == 0)
+    {
+      use_stepping_stone = TRUE; // stepping-stone logZ next to thermodynamic integration
+    }
     else if (strcmp(argv[i], "-tempering") == 0)
     {
       *minimization_engine = ENGINE_PARALLEL_TEMPERING;
       printf("Command line -- Using parallel tempering\n");
     }
+    else if (strcmp(argv[i], "-popanneal") == 0)
+    {
+      *minimization_engine = ENGINE_POPULATION_ANNEALING;
+      printf("Command line -- Using population annealing\n");
+    }
     else if (strcmp(argv[i], "-fullchain") == 0)
     {
       *dumpchain = TRUE; // write the full MCMC chain in output.fullchain
@@ -3056,6 +5146,24 @@ bool read_commandline(int *argc, char **argv, bool *benchmark, bool *use_v2, boo
         sscanf(argv[i + 1], "%lf", &reg_param[REG_L0CDF97]);
       else if (strcmp(argv[i], "-l1CDF97") == 0)
         sscanf(argv[i + 1], "%lf", &reg_param[REG_L1CDF97]);
+      else if (strcmp(argv[i], "-cdflevels") == 0)
+      {
+        sscanf(argv[i + 1], "%d", &cdf_levels);
+        if (cdf_levels < 1)
+        {
+          printf("Command line -- -cdflevels needs at least 1 level\n");
+          return FALSE;
+        }
+      }
+      else if (strcmp(argv[i], "-atrousscales") == 0)
+      {
+        sscanf(argv[i + 1], "%d", &atrous_scales);
+        if (atrous_scales < 2)
+        {
+          printf("Command line -- -atrousscales needs at least 2 scales\n");
+          return FALSE;
+        }
+      }
       else if (strcmp(argv[i], "-l0ATROUS") == 0)
         sscanf(argv[i + 1], "%lf", &reg_param[REG_L0ATROUS]);
       else if (strcmp(argv[i], "-l1ATROUS") == 0)
@@ -3076,6 +5184,45 @@ bool read_commandline(int *argc, char **argv, bool *benchmark, bool *use_v2, boo
         sscanf(argv[i + 1], "%d", nthreads);
       else if (strcmp(argv[i], "-tempschedc") == 0)
         sscanf(argv[i + 1], "%lf", tempschedc);
+      else if (strcmp(argv[i], "-mtm") == 0)
+      {
+        sscanf(argv[i + 1], "%d", &mtm_tries);
+        if ((mtm_tries < 1) || (mtm_tries > MTM_MAX_TRIES))
+        {
+          printf("Command line -- -mtm needs between 1 and %d candidates\n", MTM_MAX_TRIES);
+          return FALSE;
+        }
+      }
+      else if (strcmp(argv[i], "-quantum") == 0)
+      {
+        sscanf(argv[i + 1], "%ld", &chain_quantum);
+        if (chain_quantum < 1)
+        {
+          printf("Command line -- -quantum needs at least 1 iteration\n");
+          return FALSE;
+        }
+      }
+      else if (strcmp(argv[i], "-parthreshold") == 0)
+        sscanf(argv[i + 1], "%ld", &par_threshold);
+      else if (strcmp(argv[i], "-phasormem") == 0)
+        sscanf(argv[i + 1], "%lf", &phasor_memory_budget);
+      else if ((strcmp(argv[i], "-floatphasors") == 0) || (strcmp(argv[i], "-resync") == 0))
+      {
+        sscanf(argv[i + 1], "%ld", &dummy_long);
+        if (dummy_long < 1)
+        {
+          printf("Command line -- %s needs a resync interval of at least 1 iteration\n", argv[i]);
+          return FALSE;
+        }
+        if (strcmp(argv[i], "-floatphasors") == 0)
+        {
+          use_float_phasors = TRUE;
+          if (vis_resync == 0) // an explicit -resync takes precedence
+            vis_resync = dummy_long;
+        }
+        else
+          vis_resync = dummy_long;
+      }
       else if (strcmp(argv[i], "-fv") == 0)
         sscanf(argv[i + 1], "%lf", fov);
       else if (strcmp(argv[i], "-ct") == 0)
@@ -29,6 +29,7 @@
 // Minimization engines
 #define ENGINE_SIMULATED_ANNEALING 1
 #define ENGINE_PARALLEL_TEMPERING 2
+#define ENGINE_POPULATION_ANNEALING 3
 
 // Regularizers
 #define NREGULS 17
@@ -51,7 +52,65 @@
 #define REG_TRANSPECL2 16
 
 
+/* EDGE threshold statistics of the nonzero pixels of a channel, kept by each chain along its current image.
+ nmax and nmin count the pixels at the maximum and minimum */
+typedef struct
+{
+  double total;
+  long nnonz;
+  double max, min;
+  long nmax, nmin;
+} edge_stats;
+
+/* Values overwritten in a transform kept by a chain, so that a proposed move can be undone */
+typedef struct
+{
+  double **at;
+  double *value;
+  long n, size;
+} undo_journal;
+
+/* CDF wavelets as lifting schemes: nsteps weights, then the scalings of the low-pass (even) and high-pass (odd) samples */
+typedef struct
+{
+  int nsteps;
+  double a[4];
+  double s0, s1;
+} lifting_scheme;
+
+#define CDF_MAX_LEVELS 16
+#define CDF53 0
+#define CDF97 1
+#define NCDF 2
+
+/* CDF transform of a channel, kept by each chain along its current image. Each level keeps its input and its row pass, so that
+ a move only relifts the samples within the lifting support of the two pixels */
+typedef struct
+{
+  const lifting_scheme *scheme;
+  int nx, ny, levels;
+  double *coef;                   // coefficients, laid out as by fwt53_2D and fwt97_2D
+  double *input[CDF_MAX_LEVELS];  // low-pass quadrant of the level below, unused for the first level
+  double *rows[CDF_MAX_LEVELS];   // row pass
+  double *line;
+  undo_journal journal;           // samples written by the last move
+} cdf_state;
+
+/* A trous transform of a channel, kept by each chain along its current image. Every scale convolves the image with the filter
+ dilated by its step, so a move only changes the coefficients within the dilated footprints of the two pixels */
+typedef struct
+{
+  int nx, ny, nscales;
+  double *wav;                    // smoothed image, then the details from the largest step to the smallest, as by atrous_fwd
+  undo_journal journal;           // coefficients written by the last move
+} atrous_state;
+
+const lifting_scheme cdf53_lifting = { 2, { -0.5, 0.25 }, 1.4142135623730951, 0.70710678118654757 };
+const lifting_scheme cdf97_lifting = { 4, { -1.586134342, -0.05298011854, 0.8829110762, 0.4435068522 }, 0.81289306611596146, 0.61508705245700002 };
+const lifting_scheme *cdf_schemes[NCDF] = { &cdf53_lifting, &cdf97_lifting };
+
 const char *reg_names[NREGULS] = {"PARAM", "C", "PRI", "ENT", "DEN", "TV", "UD", "LAP", "EDGE","L0", "L0CDF53","L1CDF53", "L0CDF97", "L1CDF97",  "L0ATROUS", "L1ATROUS", "TS"};
+const int cdf_regs[NCDF][2] = { { REG_L0CDF53, REG_L1CDF53 }, { REG_L0CDF97, REG_L1CDF97 } }; // L0 and L1 regularizers of each CDF wavelet
 
 // Mathematical constants
 #define MAS_RAD          206264806.2
@@ -120,6 +179,38 @@ const char *reg_names[NREGULS] = {"PARAM", "C", "PRI", "ENT", "DEN", "TV", "UD",
 #define DEN_SUBTRACT 1
 #define DEN_INIT     65535
 
+/* Phasor tables xtransform/ytransform: row x (pixel coordinate) is split into nuv real
+ parts followed by nuv imaginary parts, so that the update loop reads unit-stride values.
+ The same layout is used for the optional single-precision copies (-floatphasors) */
+#define PHASOR_RE(t, x, j) ((t)[2 * (long)(x) * nuv + (j)])
+#define PHASOR_IM(t, x, j) ((t)[(2 * (long)(x) + 1) * nuv + (j)])
+#define PHASOR(t, x, j) (PHASOR_RE(t, x, j) + I * PHASOR_IM(t, x, j))
+
+/* Above this size (MB) of xtransform+ytransform, phasors are generated on the fly from
+ PHASOR_BASE_ROWS rows per uv point: cos/sin of the phase step, cos/sin of the smearing step, smearing step */
+#define DEFAULT_PHASOR_MEMORY 4096
+#define PHASOR_BASE_ROWS 5
+
+/* Chains with several threads (-threads > -chains) split their uv and observable loops
+ across a nested team above this many uv points or observables (-parthreshold) */
+#define DEFAULT_PAR_THRESHOLD 4096
+
+/* Multiple-try Metropolis: largest number of candidates per element move */
+#define MTM_MAX_TRIES 16
+
+/* Partial chi2 slots, cached per reconstruction channel */
+#define NCHI2         5
+#define CHI2_V2       0
+#define CHI2_T3AMP    1
+#define CHI2_VISAMP   2
+#define CHI2_T3PHI    3
+#define CHI2_VISPHI   4
+
+/* Early rejection: the bounded chi2 evaluation checks its partial sum every EARLY_REJECT_BLOCK observables.
+ The bound gets a small relative slack so that rounding never rejects a proposal the full test would accept. */
+#define EARLY_REJECT_BLOCK 32
+#define EARLY_REJECT_SLACK 1e-9
+
 /* For regularization parameters (alpha, beta etc) this is the maximum possible value */
 #define MAX_REG_PARAM 20
 
@@ -129,6 +220,132 @@ const char *reg_names[NREGULS] = {"PARAM", "C", "PRI", "ENT", "DEN", "TV", "UD",
 
 #include <complex.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#ifdef SQUEEZE_MPI
+#include <mpi.h>
+#endif
+
+/* Chains write their shared per-chain data in blocks aligned on CACHE_LINE bytes and padded to a multiple of it,
+ so that no two chains write to the same cache line */
+#define CACHE_LINE 64
+
+/* Replica exchange without a barrier. Slot p pairs the chains holding temperature storage p and p+1, each side posts
+ in its own word. At boundary b, a chain answers an offer its partner posted at b, or posts its own offer and waits,
+ without holding a thread, until the partner answers it at b or gets past b. The states tested are thus the states
+ exchanged, as detailed balance requires, and an accepted swap takes effect on both sides at boundary b.
+ slots[s].passed is the last boundary whose exchange the chain holding storage s has done (LONG_MAX once it has stopped) */
+#define SWAP_OFFERED  1
+#define SWAP_ACCEPTED 2
+#define SWAP_REJECTED 3
+
+typedef struct
+{
+  _Alignas(CACHE_LINE) atomic_long offer[2]; // [0]: side of storage p, [1]: side of storage p+1. 0 when empty, else boundary * 4 + SWAP_OFFERED/ACCEPTED/REJECTED
+  _Atomic double lPosterior[2]; // side data, written before the offer or answer is published
+  _Atomic double temperature[2];
+  atomic_long storage[2];
+  _Atomic double log_spacing; // adaptive ladder: log of the log-temperature gap between storage p and p+1
+  _Atomic double rate; // adaptive ladder: running mean of the swap acceptance probability
+  atomic_long nadapt; // number of acceptance probabilities in rate
+  atomic_long attempts, accepts; // offers answered and swaps accepted after burn-in, for the output header
+  atomic_long passed;
+} swap_slot;
+
+/* Adaptive ladder (-adaptladder): until burn-in, each answered offer moves the log-spacing of its pair by
+ LADDER_GAIN * LADDER_LAG / (iteration + LADDER_LAG) times the difference between its acceptance rate and the mean rate
+ of all pairs. Rates are running means over the last LADDER_WINDOW answers. T = 1 and the top temperature stay fixed */
+#define LADDER_GAIN   0.5
+#define LADDER_LAG    10.0
+#define LADDER_WINDOW 20
+
+/* Stepping-stone evidence (-steppingstone): logZ = sum over adjacent temperatures of log E_{hot}[exp(-(1/T_cold - 1/T_hot) * lLikelihood)],
+ from the saved likelihoods after burn-in. Its error is the spread over SS_BOOTSTRAP circular block bootstraps of the iterations,
+ with blocks of sqrt(n) iterations to keep the autocorrelation of the chains */
+#define SS_BOOTSTRAP 200
+
+/* Population annealing (-popanneal): the chains form one population of replicas, cooled together from the temperature of
+ a flat image down to T = 1 during the first 30% of the iterations, one temperature step per iteration. At each step,
+ replica r is weighted by exp(-(1/T_new - 1/T_old) * lLikelihood_r) and the population is resampled (systematic resampling):
+ replicas drawn several times are cloned into the chains of the replicas not drawn. The logs of the mean weights add up to
+ log(Z(1) / Z(1/T_start)). Chains publish their state in a population_replica before each step */
+typedef struct
+{
+  double *lLikelihood, *lPrior, *chi2v2, *chi2t3amp, *chi2t3phi, *chi2visamp, *chi2visphi;
+  unsigned short *element_x, *element_y;
+  double *image, *params, *chi2_chan, *centroid_image_x, *centroid_image_y, *reg_value, *fluxratio_image;
+  double complex *im_vis, *mod_vis, *param_vis;
+} population_replica;
+
+typedef struct
+{
+  long pair; // -1 when no offer is posted
+  int side;
+} swap_pending;
+
+/* Running likelihood moments of one temperature storage after burn-in (Welford), for the thermodynamic integration
+ of logZ. Chains update the accumulator of their current storage, so the moments follow iChaintoStorage across swaps */
+typedef struct
+{
+  _Alignas(CACHE_LINE) long count;
+  double mean;
+  double m2; // sum of squared deviations from the mean
+} lLikelihood_accumulator;
+
+/* Scalars a chain updates during its iterations, simulated annealing changing its temperature on every accepted move.
+ The shared temperature[] and burn_in_times[] arrays are published from them at iteration boundaries only, for the swap,
+ logZ, diagnostics and output code; values changed there by the exchanges or population steps are read back */
+typedef struct
+{
+  _Alignas(CACHE_LINE) double temperature;
+  unsigned int burn_in_time;
+} chain_context;
+
+/* Per-chain scratch arena for the temporaries of the regularizers and transforms: one block allocated with the chain, handed
+ out by arena_alloc in cache line aligned slices and given back by arena_free together with every slice handed out after it.
+ Requests that do not fit fall back to the heap, counted in nheap. The incremental regularizer states of the chain are
+ allocated first and stay at the bottom for the whole run */
+typedef struct
+{
+  char *base;
+  size_t size, used, peak;
+  long nheap;
+} scratch_arena;
+
+/* Chain scheduling. With more chains than threads, at most nthreads chains run at a time: every chain_quantum iterations,
+ a running chain hands its thread to the head of a FIFO run queue of waiting chains, then sleeps on its own condition
+ variable until a thread is handed back to it. Waiting chains take whichever thread frees up first */
+#define DEFAULT_CHAIN_QUANTUM 1
+
+/* MPI parallel tempering (squeeze_mpi): the ladder of -chains temperatures is split into contiguous slices, one per rank,
+ each sampled by the OpenMP engine above. Every RANK_SWAP_INTERVAL iterations, the chains holding the two temperatures
+ around a rank boundary send each other (temperature, lPosterior) and the hotter side decides; even and odd boundaries
+ alternate. Temperatures stay on their rank, so an accepted swap moves the states instead */
+#define RANK_SWAP_INTERVAL 10
+#define RANK_RNG_STREAMS 16 // random streams used by a rank besides those of its chains
+#define RANK_TAG_RANGE 32767 // smallest MPI_TAG_UB allowed by the standard
+
+/* NUMA (-numa): nodes and their cpus as listed in /sys/devices/system/node, a single node elsewhere.
+ Node n owns cpus[node_start[n]] ... cpus[node_start[n + 1] - 1] */
+#define NUMA_MAX_NODES 64
+typedef struct
+{
+  int nnodes;
+  int *node_start;
+  int *cpus;
+} numa_topology;
+#ifdef _OPENMP
+typedef struct
+{
+  pthread_mutex_t lock;
+  int free_threads; // threads not running a chain
+  int *queue; // ring of waiting chains
+  long head, tail;
+  pthread_cond_t *wake; // one per chain
+  bool *granted; // a thread was handed to the chain, cleared when it takes it
+  int nchains;
+} chain_gate;
+#endif
 
 /* Function prototypes for fred.c. Note that you have to include complex.h, and
  the complex number i is I.
@@ -151,6 +368,14 @@ void vis_to_obs(const double complex *mod_vis, double *mod_obs, const int nwavr)
 void obs_to_res(const double *mod_obs, double *res);
 double residuals_to_chi2(const double *res, double *chi2v2, double *chi2t3amp, double *chi2visamp, double *chi2t3phi, double *chi2visphi) ;
 
+void build_channel_index(const int nwavr);
+void free_channel_index(void);
+void compute_chi2_chan(double *chi2_chan, const double complex *__restrict mod_vis, const long chan, const int nwavr);
+double compute_chi2_chan_bounded(double *chi2_chan, const double complex *__restrict mod_vis, const long chan, const int nwavr, const double chi2_bound);
+double compute_chi2_chan_team(double *chi2_chan, const double complex *__restrict mod_vis, const long chan, const int nwavr, const double chi2_bound);
+void team_uv_range(const long uv_start, const long uv_end, long *sub_start, long *sub_end);
+double sum_chi2_chan(const double *chi2_chan, const int nwavr, double *chi2v2, double *chi2t3amp, double *chi2visamp, double *chi2t3phi, double *chi2visphi);
+
 double get_flat_chi2(bool benchmark, const int nwavr);
 double fill_min_elts(long *min_elts, long depth, long threadnum);
 static inline double dewrap(double diff) __attribute__((always_inline));
@@ -164,7 +389,7 @@ int writeasfits(const char *file_basename, double *image, int nwavr, long depth,
                 char *init_filename, char *prior_filename, double *params, double *params_std);
 
 void mcmc_results(int minimization_engine, char *file_basename, const int nchains, const unsigned int *burn_in_times, const long depth, const long nelements, const unsigned short axis_len,
-                            const double complex *__restrict xtransform, const double complex *__restrict ytransform,
+                            const double *__restrict xtransform, const double *__restrict ytransform,
                             const unsigned short *saved_x, const unsigned short *saved_y, const double *saved_params, const long niter,
                             const int nwavr, double *final_params, double *final_params_std,
                             double *reg_param, double *final_reg_value, const double *prior_image, const unsigned short *initial_x, const unsigned short *initial_y,
@@ -173,18 +398,54 @@ void mcmc_results(int minimization_engine, char *file_basename, const int nchain
 
 
 void compute_logZ(const double *temperature , const unsigned short *iStoragetoThread, const double *lLikelihood_expectation, const double *lLikelihood_deviation, int nchains, double *logZ, double *logZ_err);
+double stepping_stone_log_ratio(const double *lLikelihood, const long *rows, const long nrows, const double dbeta);
+void compute_logZ_ss(const double *saved_lLikelihood, const double *temperature, const unsigned short *iStoragetoChain, const int nchains, const long niter,
+                     const long burn_in, double *logZ, double *logZ_err);
 
 void mcmc_fullchain(char *file, long nchains, long niter, int nchanr, long nelements, unsigned short axis_len, unsigned short *saved_x, unsigned short *saved_y, double *saved_params, double *saved_lLikelihood, double *saved_lPrior, double *saved_lPosterior, double *temperature, unsigned short *iChaintoStorage);
 
+void draw_element_step(RngStream rng, long *rlong, const long steptype, const unsigned short *element_x, const unsigned short *element_y, const long chan,
+                       const long current_elt, const long nelements, const unsigned short axis_len, long *xstep, long *ystep);
+
+void element_move_regularizers(const double *reg_param, const double *reg_value, double *new_reg_value, double *image, const double *prior_image,
+                               const edge_stats *edge_stat, cdf_state *cdf, atrous_state *atrous, double *centroid_image_x, double *centroid_image_y, const long chan, const unsigned short old_x, const unsigned short old_y,
+                               const unsigned short new_x, const unsigned short new_y, const unsigned short axis_len, const int nwavr, const long nelements,
+                               const double fov, const double cent_mult);
+
 void compute_regularizers(const double *reg_param, double *reg_value, const double *image,
                           const double *prior_image, const double regflux, const unsigned short *initial_x,
                           const unsigned short *initial_y, const int nwavr, const unsigned short axis_len,
                           const long nelements, double *centroid_image_x, double *centroid_image_y, const double fov,
-                          const double cent_mult);
+                          const double cent_mult, scratch_arena *arena);
+
+void update_vis_element_move(double complex *__restrict new_im_vis, double complex *__restrict new_mod_vis, const double complex *__restrict im_vis,
+                             const double complex *__restrict param_vis, const double *__restrict fluxratio_image,
+                             const double *__restrict xtransform, const double *__restrict ytransform,
+                             const long new_x, const long new_y, const long old_x, const long old_y, const long uv_start, const long uv_end, const double nelements);
+
+void update_vis_element_move_float(double complex *__restrict new_im_vis, double complex *__restrict new_mod_vis, const double complex *__restrict im_vis,
+                                   const double complex *__restrict param_vis, const double *__restrict fluxratio_image,
+                                   const float *__restrict xtransform, const float *__restrict ytransform,
+                                   const long new_x, const long new_y, const long old_x, const long old_y, const long uv_start, const long uv_end, const double nelements);
+
+void update_vis_candidates(double complex *__restrict cand_vis, const double complex *__restrict im_vis, const double complex *__restrict param_vis,
+                           const double *__restrict fluxratio_image, const double *__restrict xtransform, const double *__restrict ytransform,
+                           const unsigned short *cand_x, const unsigned short *cand_y, const int ncand, const long old_x, const long old_y,
+                           const long uv_start, const long uv_end, const double nelements);
+void compute_chi2_chan_multi(double *chi2, const double complex *__restrict cand_vis, const int ncand, const long chan);
+void mtm_log_weights(double *log_weight, const unsigned short *cand_x, const unsigned short *cand_y, const int ncand, double complex *cand_vis, double *cand_reg_value,
+                     const double complex *im_vis, const double complex *param_vis, const double *fluxratio_image, const double *xtransform, const double *ytransform,
+                     const double *reg_param, const double *reg_value, double *image, const double *prior_image, const edge_stats *edge_stat, cdf_state *cdf, atrous_state *atrous,
+                     double *centroid_image_x, double *centroid_image_y, const long chan, const unsigned short old_x, const unsigned short old_y, const unsigned short axis_len, const int nwavr, const long nelements,
+                     const double fov, const double cent_mult, const double chi2_others, const double lLikelihood, const double lPrior, const double temperature);
 
-void compute_model_visibilities_fromelements(double complex *mod_vis, double complex *im_vis, double complex *param_vis, double *params, double *fluxratio_image, const unsigned short *element_x, const unsigned short *element_y, const double complex *xtransform, const double complex *ytransform, double *lPriorModel, long nparams, long nelements);
+void set_phasor_base(double *base, const long j, const double theta, const double s);
+double complex phasor_value(const double *base, const long p, const long j);
+void phasor_row(double *row, const double *base, const long p, const long uv_start, const long uv_end);
 
-void compute_model_visibilities_fromimage(double complex *mod_vis, double complex *im_vis, double complex *param_vis, const double *params, double *fluxratio_image, const double *image, const double complex *xtransform, const double complex *ytransform, double *lPriorModel, long nparams, long nelements, unsigned short axis_len);
+void compute_model_visibilities_fromelements(double complex *mod_vis, double complex *im_vis, double complex *param_vis, double *params, double *fluxratio_image, const unsigned short *element_x, const unsigned short *element_y, const double *xtransform, const double *ytransform, double *lPriorModel, long nparams, long nelements, unsigned short axis_len);
+
+void compute_model_visibilities_fromimage(double complex *mod_vis, double complex *im_vis, double complex *param_vis, const double *params, double *fluxratio_image, const double *image, const double *xtransform, const double *ytransform, double *lPriorModel, long nparams, long nelements, unsigned short axis_len);
 
 void initialize_image(int iChain, double *image, unsigned short *element_x, unsigned short *element_y, unsigned short *initial_x, unsigned short *initial_y,
                       unsigned short axis_len, int nwavr,  long nelements, char *init_filename);
@@ -207,15 +468,61 @@ double UDreg(const double *x, const double *pr, const double eps, const int nx,
 double TV(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux);
 double LAP(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux);
 double L0(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux);
-double L0_CDF53(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux);
-double L1_CDF53(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux);
-double L0_CDF97(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux);
-double L1_CDF97(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux);
-double L0_ATROUS(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux);
-double L1_ATROUS(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux);
+double L0_CDF53(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux, scratch_arena *arena);
+double L1_CDF53(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux, scratch_arena *arena);
+double L0_CDF97(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux, scratch_arena *arena);
+double L1_CDF97(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux, scratch_arena *arena);
+double L0_ATROUS(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux, scratch_arena *arena);
+double L1_ATROUS(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux, scratch_arena *arena);
 double EDGE(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux);
+int unique_sites(int *si, int *sj, const int nsites, const int imin, const int imax, const int jmin, const int jmax);
+double gradient_norm(const double *x, const int i, const int j, const int nx, const double eps);
+void gradient_sums_change(double *x, const int nx, const int ny, const int old_i, const int old_j, const int new_i, const int new_j, const double eps,
+                          double *dL1g, double *dL05g);
+double laplacian_norm(const double *x, const int i, const int j, const int nx, const int ny);
+double LAP_change(double *x, const int nx, const int ny, const int old_i, const int old_j, const int new_i, const int new_j, const double flux);
+void edge_stats_full(edge_stats *stats, const double *x, const int npix);
+void edge_stats_pixel(edge_stats *stats, const double value, const int sign);
+void edge_stats_move(edge_stats *stats, double *x, const long old_pos, const long new_pos, const int npix);
+double edge_threshold(const edge_stats *stats);
+void edge_row(const double *x, const int j, const double thresh, const int nx, const double eps, double *L05edge, double *L1edge);
+void edge_borders(const double *x, const double thresh, const int nx, const int ny, const double eps, double *L05edge, double *L1edge);
+double EDGE_change(double *x, const edge_stats *stats, const int nx, const int ny, const int old_i, const int old_j, const int new_i, const int new_j,
+                   const double eps, const double flux);
+void journal_init(undo_journal *journal, const long size, scratch_arena *arena);
+void journal_free(undo_journal *journal, scratch_arena *arena);
+void journal_set(undo_journal *journal, double *at, const double value);
+void journal_undo(undo_journal *journal);
+void sparsity_change(const double old_value, const double new_value, double *dL0, double *dL1);
+void lifting_range(double *t, const lifting_scheme *scheme, const int n, const int lo, const int hi);
+int cdf_max_levels(const int nx, const int ny);
+long cdf_journal_size(const int nx, const int ny, const int levels, const int nsteps);
+size_t cdf_state_bytes(const int nx, const int ny, const int levels, const int nsteps);
+void cdf_state_init(cdf_state *s, const lifting_scheme *scheme, const int nx, const int ny, const int levels, scratch_arena *arena);
+void cdf_state_free(cdf_state *s, scratch_arena *arena);
+void cdf_set(cdf_state *s, double *at, const double value, const bool journal);
+void cdf_store(cdf_state *s, const int level, const int row, const int col, const double value, const bool journal, double *dL0, double *dL1);
+void cdf_relift(cdf_state *s, const double *x, const int level, const int i0, const int i1, const int j0, const int j1, const bool journal, double *dL0,
+                double *dL1);
+void cdf_state_full(cdf_state *s, const double *x);
+void cdf_state_move(cdf_state *s, const double *x, const int old_i, const int old_j, const int new_i, const int new_j, double *dL0, double *dL1);
+void cdf_state_undo(cdf_state *s);
+void cdf_2D(double *wav, const double *x, const int nx, const int ny, const int levels, const lifting_scheme *scheme, scratch_arena *arena);
+void fwt53_2D(double *wav, const double* x, const int nx, const int ny, const int levels, scratch_arena *arena);
+void fwt97_2D(double *wav, const double* x, const int nx, const int ny, const int levels, scratch_arena *arena);
 void atrous_set(int idx); // a trous setup
 void atrous_fwd(const double* x, double *wav, const int nx, const int ny, const int nscales);// a trous main
+float atrous_smooth(const double *x, const int i, const int j, const int nx, const int ny, const int istep);
+int atrous_max_scales(const int nx, const int ny);
+size_t atrous_state_bytes(const int nx, const int ny, const int nscales);
+void atrous_state_init(atrous_state *s, const int nx, const int ny, const int nscales, scratch_arena *arena);
+void atrous_state_free(atrous_state *s, scratch_arena *arena);
+size_t regularizer_state_bytes(const double *reg_param, const int nx, const int ny);
+size_t regularizer_scratch_bytes(const double *reg_param, const int nx, const int ny);
+void atrous_state_full(atrous_state *s, const double *x);
+void atrous_pixel(atrous_state *s, const double *x, const int i, const int j, double *dL0, double *dL1);
+void atrous_state_move(atrous_state *s, const double *x, const int old_i, const int old_j, const int new_i, const int new_j, double *dL0, double *dL1);
+void atrous_state_undo(atrous_state *s);
 
 
 double entropy_full(const double *x, const double *pr, const double eps, const int nx, const int ny, const double flux);
@@ -228,6 +535,46 @@ double reg_prior_image(const double *x, const double *pr, const double eps, cons
 void compute_lPrior_allwav(double *lPrior, const long nwavr, const double *reg_param, const double *reg_value);
 double sinc(double x);
 
+void swap_apply(swap_slot *slot, const int side, const int iChain, double *temperature, unsigned short *iChaintoStorage, unsigned short *iStoragetoChain);
+bool swap_answer(swap_slot *slots, const long pair, const int side, long state, const long boundary, const int iChain, const int nchains, const double lPosterior,
+                 RngStream rng, double *temperature, unsigned short *iChaintoStorage, unsigned short *iStoragetoChain, const long burn_in);
+bool swap_attempt(swap_slot *slots, swap_pending *pending, const long boundary, const int iChain, const int nchains, const double lPosterior, RngStream rng,
+                  double *temperature, unsigned short *iChaintoStorage, unsigned short *iStoragetoChain, const long burn_in);
+void swap_wait(swap_slot *slots, swap_pending *pending, const long boundary, const int iChain, const int nchains, const double lPosterior, RngStream rng,
+               double *temperature, unsigned short *iChaintoStorage, unsigned short *iStoragetoChain, const long burn_in);
+void init_ladder(swap_slot *slots, const int nchains, const double tempschedc);
+double ladder_temperature(swap_slot *slots, const int nchains, const long storage, const double log_tmax);
+void adapt_ladder(swap_slot *slots, const int nchains, const long pair, const long boundary, const double acceptance);
+#ifdef _OPENMP
+bool chain_gate_init(chain_gate *gate, const int nchains, const int nthreads);
+void chain_gate_enter(chain_gate *gate, const int iChain);
+void chain_gate_yield(chain_gate *gate, const int iChain);
+void chain_gate_leave(chain_gate *gate);
+void chain_gate_free(chain_gate *gate);
+#endif
+#ifdef SQUEEZE_MPI
+void *rank_gather(void *local, const size_t bytes);
+int rank_swap(const int peer, const long boundary, const bool available, RngStream rng, const double temperature, double *lLikelihood, double *lPrior,
+              double *chi2v2, double *chi2t3amp, double *chi2t3phi, double *chi2visamp, double *chi2visphi, unsigned short *element_x, unsigned short *element_y,
+              double *image, double complex *im_vis, double complex *mod_vis, double complex *param_vis, double *params, double *chi2_chan,
+              double *centroid_image_x, double *centroid_image_y, double *reg_value, double *fluxratio_image, int *trip_end, long *trip_start,
+              const long nelements, const int nwavr, const unsigned short axis_len);
+#endif
+void *cache_aligned_calloc(const size_t count, const size_t size);
+size_t arena_slice(const size_t bytes);
+void arena_init(scratch_arena *arena, const size_t size);
+void *arena_alloc(scratch_arena *arena, const size_t bytes);
+void arena_free(scratch_arena *arena, void *block);
+double population_resample(const double *lLikelihood, const int nreplicas, const double dbeta, RngStream rng, int *ancestor, double *ess, double *log_weight_var,
+                           scratch_arena *arena);
+void clone_replica(const population_replica *from, const population_replica *to, const long nelements, const int nwavr, const unsigned short axis_len);
+void read_numa_topology(numa_topology *topo);
+void free_numa_topology(numa_topology *topo);
+bool pin_thread(const int *cpus, const int ncpus);
+void accumulate_lLikelihood(lLikelihood_accumulator *acc, const double lLikelihood);
+void lLikelihood_moments(const lLikelihood_accumulator *acc, double *expectation, double *deviation);
+void storage_logZ(const lLikelihood_accumulator *accumulators, const double *temperature, const unsigned short *iStoragetoChain, const int nchains,
+                  double *lLikelihood_expectation, double *lLikelihood_deviation, double *logZ, double *logZ_err);
 inline void swapi(unsigned short *a, unsigned short *b);
 inline void swapd(double *a, double *b);
 double xatan2(double y, double x);
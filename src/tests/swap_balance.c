@@ -0,0 +1,100 @@
+/*
+ *  SQUEEZE - Image reconstruction software for optical interferometry,
+ *  based on Monte-Carlo Markov Chain algorithms.
+ *
+ *  Detailed balance of the replica exchange on toy targets.
+ *  Chains sample exp(-E(x) / T) over NSTATES states with an independence sampler, and try a swap at every iteration
+ *  boundary through swap_attempt / swap_wait as the main loop does: two temperatures with random neighbours, then three
+ *  with the even/odd schedule (-deo). The product target is kept only if the states exchanged are those the swap was
+ *  tested on: the histogram of each temperature must then converge to its Boltzmann distribution. With -deo, pair p must
+ *  also be tried at every round b with p + b even, and only then. Exits with 1 when a check fails
+ */
+#define main squeeze_main
+#include "../squeeze.c"
+#undef main
+
+#define NSTATES   6
+#define NBOUNDARY 200000
+#define TOLERANCE 0.01
+#define MAX_TEST_CHAINS 3
+
+int balance_run(const int nchains, const double *ladder, const bool deo)
+{
+  const double energy[NSTATES] = { 0.0, 2.0, 4.0, 1.0, 3.0, 0.5 };
+  double temperature[MAX_TEST_CHAINS];
+  unsigned short iChaintoStorage[MAX_TEST_CHAINS], iStoragetoChain[MAX_TEST_CHAINS];
+  long histogram[MAX_TEST_CHAINS][NSTATES] = { { 0 } };
+  swap_slot *slots = cache_aligned_calloc(nchains, sizeof(swap_slot));
+  long s, x;
+  int failed = 0;
+
+  for (s = 0; s < nchains; ++s)
+  {
+    temperature[s] = ladder[s];
+    iChaintoStorage[s] = s;
+    iStoragetoChain[s] = s;
+  }
+  use_deo_swaps = deo;
+  fflush(stdout);
+  FILE *swap_log = freopen("/dev/null", "w", stdout); // one line per accepted swap
+  #pragma omp parallel num_threads(nchains)
+  {
+#ifdef _OPENMP
+    const int iChain = omp_get_thread_num();
+#else
+    const int iChain = 0;
+#endif
+    char rngname[80];
+    sprintf(rngname, "balance%d", iChain);
+    RngStream rng = RngStream_CreateStream(rngname);
+    swap_pending pending = { .pair = -1 };
+    long b;
+    int state = 0, proposed;
+    for (b = 1; b <= NBOUNDARY; ++b)
+    {
+      proposed = (int)(NSTATES * RngStream_RandU01(rng));
+      if (log(RngStream_RandU01(rng)) < -(energy[proposed] - energy[state]) / temperature[iChain])
+        state = proposed;
+      if (swap_attempt(slots, &pending, b, iChain, nchains, energy[state], rng, temperature, iChaintoStorage, iStoragetoChain, 0) == TRUE)
+        swap_wait(slots, &pending, b, iChain, nchains, energy[state], rng, temperature, iChaintoStorage, iStoragetoChain, 0);
+      atomic_store(&slots[iChaintoStorage[iChain]].passed, b);
+      histogram[iChaintoStorage[iChain]][state]++;
+    }
+    atomic_store(&slots[iChaintoStorage[iChain]].passed, LONG_MAX);
+    RngStream_DeleteStream(&rng);
+  }
+  if (swap_log != NULL)
+    fclose(swap_log);
+
+  for (s = 0; s < nchains; ++s)
+  {
+    double z = 0, deviation = 0;
+    long count = 0;
+    for (x = 0; x < NSTATES; ++x)
+    {
+      z += exp(-energy[x] / ladder[s]);
+      count += histogram[s][x];
+    }
+    for (x = 0; x < NSTATES; ++x)
+      deviation = fmax(deviation, fabs((double) histogram[s][x] / count - exp(-energy[x] / ladder[s]) / z));
+    fprintf(stderr, "%s, T = %f: %ld samples, largest probability error %f\n", deo ? "Even/odd" : "Random", ladder[s], count, deviation);
+    if (deviation > TOLERANCE)
+      failed = 1;
+  }
+  for (s = 0; s < nchains - 1; ++s)
+  {
+    fprintf(stderr, "%s, pair %ld: %ld of %ld swaps accepted\n", deo ? "Even/odd" : "Random", s, atomic_load(&slots[s].accepts),
+            atomic_load(&slots[s].attempts));
+    if ((deo == TRUE) && (atomic_load(&slots[s].attempts) != (NBOUNDARY + s % 2) / 2)) // rounds 1 ... NBOUNDARY with s + b even
+      failed = 1;
+  }
+  free(slots);
+  return failed;
+}
+
+int main(void)
+{
+  const double two[2] = { 1.0, 3.0 }, three[3] = { 1.0, 2.0, 4.0 };
+  const int failed = balance_run(2, two, FALSE) | balance_run(3, three, TRUE);
+  return failed;
+}